@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+// Every allocation of the library is counted, to report the bytes allocated per operation
+size_t allocations = 0, allocated = 0;
+
+void *counted_malloc(size_t size) {
+	allocations++;
+	allocated += size;
+	return malloc(size);
+}
+
+#define VNN_MALLOC counted_malloc
+#define VNN_FREE free
+
+#include "vnn.h"
+
+const size_t warmup_ns = 20000000, trial_ns = 50000000, trials = 5;
+
+typedef struct {
+	Matrix lhs, rhs;
+	Network nn;
+	Matrix input, target;
+} Workload;
+
+typedef struct {
+	double ns, bytes, allocations;
+} Measure;
+
+float weights(void) {
+	return (float) rand() / (float) RAND_MAX - 0.5;
+}
+
+float activation(float excitation) {
+	return 1.0/(1.0 + exp(-excitation));
+}
+
+float derivative(float excitation) {
+	return activation(excitation) * (1.0 - activation(excitation));
+}
+
+double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec*1e9 + time.tv_nsec;
+}
+
+// Same networks as in `xor.c` and `ones.c`, with their shapes known at compile time
+NETWORK_SPECIALIZE(xor, 2, 2, 1, activation, derivative, NETWORK_LOSS_MSE)
+NETWORK_SPECIALIZE(ones, 2, 3, 2, activation, derivative, NETWORK_LOSS_MSE)
+
+int compare(const void *lhs, const void *rhs) {
+	double a = *(const double *) lhs, b = *(const double *) rhs;
+	return (a > b) - (a < b);
+}
+
+void multiply(Workload *work) {
+	Matrix result = matrix_multiply(work->lhs, work->rhs);
+	matrix_free(&result);
+}
+
+void diagonalize(Workload *work) {
+	Matrix result = matrix_diagonalize(work->lhs);
+	matrix_free(&result);
+}
+
+void apply(Workload *work) {
+	matrix_apply(work->lhs, activation);
+}
+
+void add(Workload *work) {
+	Matrix result = matrix_add(work->lhs, work->rhs);
+	matrix_free(&result);
+}
+
+// Update of the weights in place by deltas already scaled, i.e. `lhs += rhs` as in `network_adjust`, by a plain loop and lazily
+void update_loop(Workload *work) {
+	for (size_t i = 0; i < work->lhs.rows*work->lhs.cols; i++) {
+		work->lhs.data[i] += work->rhs.data[i];
+	}
+}
+
+void update_lazy(Workload *work) {
+	matrix_evaluate(work->lhs, MATRIX_LAZY_ADD(MATRIX_LAZY(work->lhs), MATRIX_LAZY(work->rhs)));
+}
+
+// Update of the weights by a transposed delta, i.e. `lhs + (-0.01) * transpose(rhs)`, as separate passes and fused
+void update_transposed(Workload *work) {
+	Matrix delta = matrix_clone(work->rhs);
+	matrix_negate(delta);
+	matrix_multiply_scalar(delta, 0.01);
+	matrix_transpose(&delta);
+
+	Matrix result = matrix_add(work->lhs, delta);
+	matrix_free(&result);
+	matrix_free(&delta);
+}
+
+void update_transposed_lazy(Workload *work) {
+	Matrix result = matrix_materialize(
+		MATRIX_LAZY_ADD(MATRIX_LAZY(work->lhs), MATRIX_LAZY_SCALE(MATRIX_LAZY_TRANSPOSE(MATRIX_LAZY(work->rhs)), -0.01))
+	);
+	matrix_free(&result);
+}
+
+// Initialization of `lhs` from a callback, as `network_new` does, and from the built-in generators
+void rand_callback(Workload *work) {
+	for (size_t i = 0; i < work->lhs.rows*work->lhs.cols; i++) {
+		work->lhs.data[i] = weights();
+	}
+}
+
+void uniform(Workload *work) {
+	matrix_uniform(work->lhs, -0.5, 0.5, 0, 0);
+}
+
+void normal(Workload *work) {
+	matrix_normal(work->lhs, 0, 1, 0, 0);
+}
+
+void feed(Workload *work) {
+	network_feed(work->nn, work->input);
+}
+
+void step(Workload *work) {
+	network_feed(work->nn, work->input);
+	network_adjust(work->nn, work->target);	// Error comes along with the adjustment
+}
+
+void feed_xor(Workload *work) {
+	VNN_DTYPE output[1];
+	xor_feed(work->nn.weights, work->input.data, output);
+}
+
+void step_xor(Workload *work) {
+	xor_adjust(work->nn.weights, work->nn.rate, work->input.data, work->target.data);
+}
+
+void feed_ones(Workload *work) {
+	VNN_DTYPE output[2];
+	ones_feed(work->nn.weights, work->input.data, output);
+}
+
+void step_ones(Workload *work) {
+	ones_adjust(work->nn.weights, work->nn.rate, work->input.data, work->target.data);
+}
+
+// Runs `kernel` until warmed up, then picks the number of iterations making each trial last about
+// `trial_ns` and returns the median time of the trials, with the allocations of a single iteration
+Measure measure(void (*kernel)(Workload *), Workload *work) {
+	size_t iterations = 0;
+	double start = now();
+	while (now() - start < warmup_ns) {
+		kernel(work);
+		iterations++;
+	}
+	iterations = iterations * trial_ns / warmup_ns;
+	if (iterations == 0) {
+		iterations = 1;
+	}
+
+	double times[trials];
+	Measure result = {0};
+	for (size_t i = 0; i < trials; i++) {
+		allocations = allocated = 0;
+
+		start = now();
+		for (size_t j = 0; j < iterations; j++) {
+			kernel(work);
+		}
+		times[i] = (now() - start) / iterations;
+
+		result.bytes = (double) allocated / iterations;
+		result.allocations = (double) allocations / iterations;
+	}
+
+	qsort(times, trials, sizeof(times[0]), compare);
+	result.ns = times[trials/2];
+	return result;
+}
+
+void report(FILE *csv, const char *kernel, const char *shape, Measure result, double flops, size_t samples) {
+	double gflops = flops / result.ns, throughput = samples * 1e9 / result.ns;
+
+	printf("%-12s %-24s %14.1f %10.3f %14.0f %8.1f", kernel, shape, result.ns, gflops, result.bytes, result.allocations);
+	if (samples > 0) {
+		printf(" %14.1f", throughput);
+	}
+	printf("\n");
+
+	if (csv != NULL) {
+		fprintf(csv, "%s,%s,%.1f,%.6f,%.0f,%.1f,%.1f\n", kernel, shape, result.ns, gflops, result.bytes, result.allocations, throughput);
+		fflush(csv);
+	}
+}
+
+// Formats a network shape like `{2, 2, 1}` as "2-2-1", and sums up its feed forward FLOPs for one sample
+double network_shape(char *name, size_t length, size_t *shape, size_t layers) {
+	double flops = 0;
+	size_t written = 0;
+	for (size_t i = 0; i < layers; i++) {
+		written += snprintf(&name[written], length - written, i > 0 ? "-%lu" : "%lu", (unsigned long) shape[i]);
+		if (i > 0) {
+			flops += 2.0 * (shape[i-1]+1) * shape[i];
+		}
+	}
+	return flops;
+}
+
+int main(int argc, char **argv) {
+	srand(0);
+
+	FILE *csv = NULL;
+	if (argc > 1) {
+		csv = fopen(argv[1], "w");
+		if (csv == NULL) {
+			perror(argv[1]);
+			return 1;
+		}
+		fprintf(csv, "kernel,shape,ns_per_op,gflops,bytes_per_op,allocs_per_op,samples_per_s\n");
+	}
+
+	printf("%-12s %-24s %14s %10s %14s %8s %14s\n", "kernel", "shape", "ns/op", "GFLOP/s", "bytes/op", "allocs", "samples/s");
+
+	char shape[64];
+	Workload work = {0};
+
+	size_t sizes[] = {2, 16, 64, 256, 512};
+	for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		unsigned long n = sizes[i];
+
+		// Square products, and the vector times matrix products of the feed forward step
+		work.lhs = matrix_rand(n, n, weights);
+		work.rhs = matrix_rand(n, n, weights);
+		snprintf(shape, sizeof(shape), "%lux%lu.%lux%lu", n, n, n, n);
+		report(csv, "multiply", shape, measure(multiply, &work), 2.0*n*n*n, 0);
+		report(csv, "add", shape, measure(add, &work), n*n, 0);
+		report(csv, "update/loop", shape, measure(update_loop, &work), n*n, 0);
+		report(csv, "update/lazy", shape, measure(update_lazy, &work), n*n, 0);
+
+		snprintf(shape, sizeof(shape), "%lux%lu.(%lux%lu)^T", n, n, n, n);
+		report(csv, "update", shape, measure(update_transposed, &work), 2.0*n*n, 0);
+		report(csv, "update/lazy", shape, measure(update_transposed_lazy, &work), 2.0*n*n, 0);
+
+		// Random values are counted as a single operation each
+		snprintf(shape, sizeof(shape), "%lux%lu", n, n);
+		report(csv, "rand", shape, measure(rand_callback, &work), n*n, 0);
+		report(csv, "uniform", shape, measure(uniform, &work), n*n, 0);
+		report(csv, "normal", shape, measure(normal, &work), n*n, 0);
+		matrix_free(&work.lhs);
+
+		work.lhs = matrix_rand(1, n, weights);
+		snprintf(shape, sizeof(shape), "1x%lu.%lux%lu", n, n, n);
+		report(csv, "multiply", shape, measure(multiply, &work), 2.0*n*n, 0);
+
+		// As in the propagation of the backward step, i.e. by the transposed weights
+		matrix_transpose(&work.rhs);
+		snprintf(shape, sizeof(shape), "1x%lu.(%lux%lu)^T", n, n, n);
+		report(csv, "multiply", shape, measure(multiply, &work), 2.0*n*n, 0);
+		matrix_transpose(&work.rhs);
+
+		// Activations are counted as a single operation each
+		snprintf(shape, sizeof(shape), "1x%lu", n);
+		report(csv, "apply", shape, measure(apply, &work), n, 0);
+		report(csv, "diagonalize", shape, measure(diagonalize, &work), 0, 0);
+
+		matrix_free(&work.lhs);
+		matrix_free(&work.rhs);
+	}
+
+	struct {
+		size_t shape[4], layers, batch;
+		void (*feed)(Workload *), (*step)(Workload *);	// Specialized with `NETWORK_SPECIALIZE`, if any
+	} networks[] = {
+		{{2, 2, 1}, 3, 1, feed_xor, step_xor},	// As in `xor.c`
+		{{2, 3, 2}, 3, 1, feed_ones, step_ones},	// As in `ones.c`
+		{{25, 100, 20, 10}, 4, 1, NULL, NULL},	// As in `short.c`
+		{{25, 100, 20, 10}, 4, 32, NULL, NULL},
+		{{784, 256, 10}, 3, 1, NULL, NULL},
+		{{784, 256, 10}, 3, 32, NULL, NULL},
+		{{1024, 2048, 1024, 10}, 4, 1, NULL, NULL},
+		{{1024, 2048, 1024, 10}, 4, 32, NULL, NULL}
+	};
+	for (size_t i = 0; i < sizeof(networks)/sizeof(networks[0]); i++) {
+		size_t layers = networks[i].layers, batch = networks[i].batch;
+
+		float (*activations[3])(float) = {activation, activation, activation};
+		float (*derivatives[3])(float) = {derivative, derivative, derivative};
+		work.nn = network_new(networks[i].shape, layers, 0.01, activations, derivatives, weights);
+		work.input = matrix_rand(batch, networks[i].shape[0], weights);
+		work.target = matrix_zeros(batch, networks[i].shape[layers-1]);
+
+		// Backward step is about twice the feed forward, once for the gradients
+		// and once for the propagation, minus the propagation to the inputs
+		double flops = network_shape(shape, sizeof(shape), networks[i].shape, layers) * batch;
+		double propagation = 2.0 * networks[i].shape[0] * networks[i].shape[1] * batch;
+		snprintf(&shape[strlen(shape)], sizeof(shape) - strlen(shape), "/%lu", (unsigned long) batch);
+
+		report(csv, "feed", shape, measure(feed, &work), flops, batch);
+		report(csv, "step", shape, measure(step, &work), 3*flops - propagation, batch);
+		if (networks[i].feed != NULL) {
+			report(csv, "feed/static", shape, measure(networks[i].feed, &work), flops, batch);
+			report(csv, "step/static", shape, measure(networks[i].step, &work), 3*flops - propagation, batch);
+		}
+
+		network_free(&work.nn);
+		matrix_free(&work.input);
+		matrix_free(&work.target);
+	}
+
+	if (csv != NULL) {
+		fclose(csv);
+	}
+}
@@ -0,0 +1,103 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define VNN_THREADS
+#include "vnn.h"
+
+#define TRAINING 2000
+#define VALIDATION 1000
+#define BATCH 16
+
+float activation(float excitation) {
+	return 1.0/(1.0 + exp(-excitation));
+}
+
+float derivative(float excitation) {
+	return activation(excitation) * (1.0 - activation(excitation));
+}
+
+// Points within the square $[-1, 1]^2$ belong to one of three rings around the origin,
+// except for a few whose label is flipped at random, so that the network can overfit them
+void rings(Matrix inputs, Matrix targets, uint64_t seed) {
+	Matrix noise = matrix_empty(inputs.rows, 2);
+	matrix_uniform(inputs, -1, 1, seed, 0);
+	matrix_uniform(noise, 0, 1, seed, 1);
+
+	for (size_t i = 0; i < inputs.rows; i++) {
+		float x = MATRIX_AT(inputs, i, 0), y = MATRIX_AT(inputs, i, 1), radius = sqrtf(x*x + y*y);
+		size_t ring = radius < 0.5 ? 0 : radius < 0.8 ? 1 : 2;
+		if (MATRIX_AT(noise, i, 0) < 0.1) {
+			ring = (ring + 1 + (MATRIX_AT(noise, i, 1) < 0.5)) % 3;
+		}
+
+		for (size_t j = 0; j < 3; j++) {
+			MATRIX_AT(targets, i, j) = j == ring;
+		}
+	}
+
+	matrix_free(&noise);
+}
+
+bool report(NetworkEvaluation result, void *data) {
+	(void) data;
+	if (result.improved) {
+		printf("Epoch %lu, Validation loss: %.6f, Accuracy: %.1f%%\n", (unsigned long) result.tag, result.loss, result.accuracy*100);
+	}
+	return false;	// Patience alone decides when to stop
+}
+
+int main(void) {
+	const size_t epochs = 1000;
+
+	Matrix inputs = matrix_empty(TRAINING, 2), targets = matrix_empty(TRAINING, 3);
+	Matrix held_inputs = matrix_empty(VALIDATION, 2), held_targets = matrix_empty(VALIDATION, 3);
+	rings(inputs, targets, 1);
+	rings(held_inputs, held_targets, 2);
+
+	Network nn = network_new(
+		(size_t[]) {2, 32, 32, 3}, 4, 3,
+		(float (*[])(float)) {activation, activation, activation},
+		(float (*[])(float)) {derivative, derivative, derivative},
+		NULL
+	);
+	network_init(nn, NETWORK_INIT_XAVIER, 0);
+	nn.loss = NETWORK_LOSS_CROSS_ENTROPY;
+
+	// Weights are evaluated in the background on the held-out samples after every epoch,
+	// and training stops once they haven't improved for a while
+	NetworkEvaluator *evaluator = network_evaluator_new(nn, held_inputs, held_targets, 128, 20, report, NULL);
+
+	size_t e;
+	for (e = 1; e <= epochs && !network_evaluator_stopped(evaluator); e++) {
+		float error = 0;
+		for (size_t i = 0; i < TRAINING; i += BATCH) {
+			network_feed(nn, matrix_from(&inputs.data[i*2], BATCH, 2));
+			error += network_adjust(nn, matrix_from(&targets.data[i*3], BATCH, 3));
+		}
+
+		network_evaluator_submit(evaluator, nn, e);
+		if (e % 10 == 0) {
+			printf("Epoch %lu, Training loss: %.6f\n", (unsigned long) e, error / (TRAINING / BATCH));
+		}
+	}
+	network_evaluator_wait(evaluator);
+
+	NetworkEvaluation best = evaluator->best;
+	printf(
+		"Stopped after %lu epochs, Best: epoch %lu with loss %.6f, accuracy %.1f%%\n",
+		(unsigned long) e-1, (unsigned long) best.tag, best.loss, best.accuracy*100
+	);
+
+	NetworkEvaluation last = network_evaluate(nn, held_inputs, held_targets, 128);
+	printf("Last weights, Loss: %.6f, Accuracy: %.1f%%\n", last.loss, last.accuracy*100);
+
+	network_evaluator_free(evaluator);
+	network_free(&nn);
+	matrix_free(&inputs);
+	matrix_free(&targets);
+	matrix_free(&held_inputs);
+	matrix_free(&held_targets);
+}
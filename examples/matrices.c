@@ -39,12 +39,19 @@ int main(void) {
 	matrix_transpose(&ab);
 	matrix_print(ab);
 
+	printf("\n");
+	Matrix e = matrix_materialize(	// c - 3 * ab^T in a single pass
+		MATRIX_LAZY_SUBTRACT(MATRIX_LAZY(c), MATRIX_LAZY_SCALE(MATRIX_LAZY_TRANSPOSE(MATRIX_LAZY(ab)), 3))
+	);
+	matrix_print(e);
+
 	printf("\n");
 	Matrix d = matrix_from((float *) "\x00\x00\x00\x00\x00\x00\x80\x40", 1, 2);	// {0, 4} in LE IEE754
 	d = matrix_clone(d);
 	matrix_add_scalar(d, 2);	// Would segfault without cloning `d`
 	matrix_print(d);
 
+	matrix_free(&e);
 	matrix_free(&d);
 	matrix_free(&c);
 	matrix_free(&ab);
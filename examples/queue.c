@@ -0,0 +1,78 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+
+#define VNN_THREADS
+#include "vnn.h"
+
+#define CLIENTS 64
+#define REQUESTS 500	// Sent by each client, one at a time
+
+float weights(void) {
+	return (float) rand() / (float) RAND_MAX - 0.5;
+}
+
+float activation(float excitation) {
+	return 1.0/(1.0 + exp(-excitation));
+}
+
+float derivative(float excitation) {
+	return activation(excitation) * (1.0 - activation(excitation));
+}
+
+NetworkQueue *queue;
+float inputs[CLIENTS][128];
+
+// Each client behaves like a caller of a service, waiting for its answer before asking again
+void *client(void *data) {
+	float *sample = data;
+	for (size_t i = 0; i < REQUESTS; i++) {
+		sample[i % 128] = (float) i / REQUESTS;
+
+		Matrix output = network_queue_infer(queue, matrix_from(sample, 1, 128));
+		matrix_free(&output);
+	}
+	return NULL;
+}
+
+int main(void) {
+	srand(time(NULL));
+
+	Network nn = network_new(
+		(size_t[]) {128, 512, 512, 10}, 4, 1,
+		(float (*[])(float)) {activation, activation, activation},
+		(float (*[])(float)) {derivative, derivative, derivative},
+		NULL
+	);
+	network_init(nn, NETWORK_INIT_XAVIER, time(NULL));	// Split between the workers, since `VNN_THREADS` is defined
+	for (size_t i = 0; i < CLIENTS; i++) {
+		for (size_t j = 0; j < 128; j++) {
+			inputs[i][j] = weights();
+		}
+	}
+
+	// Part of the same load, served one sample at a time
+	clock_t elapsed = clock();
+	for (size_t i = 0; i < CLIENTS*REQUESTS / 10; i++) {
+		network_predict(nn, matrix_from(inputs[i % CLIENTS], 1, 128));
+	}
+	elapsed = clock() - elapsed;
+	printf("Unbatched throughput: %.1f requests/s\n\n", CLIENTS*REQUESTS / 10 / ((double) elapsed / CLOCKS_PER_SEC));
+
+	queue = network_queue_new(nn, 32, 0.002);	// Up to 32 requests, waiting 2ms at most
+
+	pthread_t clients[CLIENTS];
+	for (size_t i = 0; i < CLIENTS; i++) {
+		pthread_create(&clients[i], NULL, client, inputs[i]);
+	}
+	for (size_t i = 0; i < CLIENTS; i++) {
+		pthread_join(clients[i], NULL);
+	}
+
+	network_queue_dump(queue, stdout);
+	network_queue_free(queue);
+	network_free(&nn);
+}
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 199309L	// Wall clock for `VNN_PROFILE`
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -29,6 +31,16 @@ float fix(float input) {
 
 const size_t samples = 10;
 
+// Whether the largest output is the one of the expected digit
+bool recognized(Matrix output, size_t digit) {
+	for (size_t i = 0; i < output.cols; i++) {
+		if (MATRIX_AT(output, 0, i) > MATRIX_AT(output, 0, digit)) {
+			return false;
+		}
+	}
+	return true;
+}
+
 int16_t serif[][5] = {
 	{0,1,1,1,0},	// 0
 	{1,0,0,0,1},
@@ -219,7 +231,7 @@ int16_t blocky[][5] = {
 int main(void) {
 	srand(time(NULL));
 
-	const size_t epochs = 2500;
+	const size_t epochs = 500;
 
 	Matrix inputs[samples*3], targets[samples];
 	for (size_t i = 0; i < samples; i++) {
@@ -235,18 +247,18 @@ int main(void) {
 	}
 
 	Network nn = network_new(
-		(size_t[]) {5*5, 100, 20, 10}, 4, 3,
+		(size_t[]) {5*5, 100, 20, 10}, 4, 0.5,
 		(float (*[])(float)) {activation, activation, activation},
 		(float (*[])(float)) {derivative, derivative, derivative},
 		weights
 	);
+	nn.loss = NETWORK_LOSS_CROSS_ENTROPY;	// Converges much faster than the MSE for classification
 
 	for (size_t e = 1; e <= epochs; e++) {
 		float error = 0;
 		for (size_t i = 0; i < samples*2; i++) {	// TIP: Try to change `*2` to `*3` for control to be recognized
 			network_feed(nn, inputs[i]);
-			error += network_error(nn, targets[i % samples]);
-			network_adjust(nn, targets[i % samples]);
+			error += network_adjust(nn, targets[i % samples]);	// Error before the adjustment
 		}
 		error /= samples*2;
 
@@ -254,6 +266,43 @@ int main(void) {
 	}
 	printf("\n");
 
+#ifdef VNN_PROFILE
+	network_profile_dump(nn, stdout);	// TIP: Define `VNN_PROFILE` to see where the time goes
+	network_profile_reset(nn);
+#endif
+
+	// Dropping weights without retraining raises the error, so the ratio is what this network tolerates: at 40%
+	// every sample is still recognized with a few times the error, while at 60% some of them usually no longer are.
+	// The error and the accuracy of the dense and pruned weights are compared on the same samples
+	const size_t repeats = 1000;
+	float error[2] = {0};
+	size_t correct[2] = {0};
+	clock_t times[2];
+	float sparsity = 0;
+	for (size_t pruned = 0; pruned < 2; pruned++) {
+		if (pruned) {
+			sparsity = network_prune(nn, network_threshold(nn, 0.4));
+		}
+
+		times[pruned] = clock();
+		for (size_t r = 0; r < repeats; r++) {
+			for (size_t i = 0; i < samples*2; i++) {
+				Matrix output = network_feed(nn, inputs[i]);
+				if (r == 0) {
+					error[pruned] += network_error(nn, targets[i % samples]) / (samples*2);
+					correct[pruned] += recognized(output, i % samples);
+				}
+			}
+		}
+		times[pruned] = clock() - times[pruned];
+	}
+
+	printf("Dense, Error: %.10f, Accuracy: %.1f%%\n", error[0], 100.0 * correct[0] / (samples*2));
+	printf(
+		"Pruned %.1f%% of the weights, Speedup: %.2fx, Error: %.10f, Accuracy: %.1f%%\n",
+		sparsity*100, (float) times[0]/times[1], error[1], 100.0 * correct[1] / (samples*2)
+	);
+
 	for (size_t i = 0; i < samples; i++) {
 		size_t set = rand() % 3;	// Choose between `serif`, `segments` and `blocky`
 		Matrix input = inputs[samples*set + i];
@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
+#include <stdint.h>
 
 #if !defined(VNN_MALLOC) && !defined(VNN_FREE)
 #include <stdlib.h>
@@ -13,7 +15,68 @@
 #define VNN_FREE free
 #endif
 
-#define VNN_CALLOC(s) (memset(VNN_MALLOC(s), 0, (s)))
+#ifdef VNN_PROFILE
+#include <time.h>
+
+// Allocations are counted by each thread since its start, so that a phase, which begins and ends on the
+// same thread, only counts its own even while other threads use the library, and without any race
+#if !defined(VNN_THREADS)
+#define VNN_THREAD_LOCAL
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define VNN_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define VNN_THREAD_LOCAL __thread
+#else
+#error "VNN_PROFILE along with VNN_THREADS needs thread-local storage, i.e. C11 or a GNU compiler"
+#endif
+
+static VNN_THREAD_LOCAL size_t vnn_allocated = 0, vnn_allocations = 0;
+#define VNN_ALLOC(s) (vnn_allocated += (s), vnn_allocations++, VNN_MALLOC(s))
+
+// Wall time in seconds, since processor time adds up all threads and would skew GFLOP/s.
+// NOTE: Plain C99 has no such clock, so POSIX might have to be requested with `_POSIX_C_SOURCE`
+#ifndef VNN_PROFILE_CLOCK
+#if defined(CLOCK_MONOTONIC)
+static double vnn_clock(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+#elif defined(TIME_UTC)
+static double vnn_clock(void) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+#else
+#error "VNN_PROFILE needs a wall clock, e.g. by defining _POSIX_C_SOURCE as 199309L, or VNN_PROFILE_CLOCK"
+#endif
+#define VNN_PROFILE_CLOCK() vnn_clock()
+#endif
+
+#define VNN_PROFILE_BEGIN(src, layer, phase) network_profile_begin((src), (layer), (phase))
+#define VNN_PROFILE_END(src, layer, phase, flops) network_profile_end((src), (layer), (phase), (flops))
+#else
+#define VNN_ALLOC(s) VNN_MALLOC(s)
+#define VNN_PROFILE_BEGIN(src, layer, phase)
+#define VNN_PROFILE_END(src, layer, phase, flops)
+#endif
+
+#define VNN_CALLOC(s) (memset(VNN_ALLOC(s), 0, (s)))
+
+#ifndef VNN_SCRATCH
+#define VNN_SCRATCH 256	// Floats of scratch space kept on the stack, above which it's allocated instead
+#endif
+
+// NOTE: Threads need POSIX, which might have to be requested with `_POSIX_C_SOURCE`
+#ifdef VNN_THREADS
+#include <pthread.h>
+#include <time.h>
+
+#ifndef VNN_WORKERS
+#define VNN_WORKERS 4	// Threads sharing any work that can be split up
+#endif
+#endif
 
 #ifndef VNN_DTYPE
 #define VNN_DTYPE float
@@ -45,6 +108,7 @@ VNNDEF Matrix matrix_resize(Matrix src, size_t rows, size_t cols, float extend);
 VNNDEF Matrix matrix_diagonalize(Matrix src);
 VNNDEF Matrix matrix_add(Matrix lhs, Matrix rhs);
 VNNDEF Matrix matrix_multiply(Matrix lhs, Matrix rhs);
+VNNDEF void matrix_multiply_into(Matrix dest, Matrix lhs, Matrix rhs, float scale);	// NOTE: `dest` can't be `lhs` nor `rhs`
 
 VNNDEF Matrix matrix_from(VNN_DTYPE *data, size_t rows, size_t cols);	// NOTE: If `data` is read-only, the result must be `matrix_clone`d
 VNNDEF void matrix_add_scalar(Matrix dest, float scalar);
@@ -55,35 +119,331 @@ VNNDEF void matrix_negate(Matrix dest);
 VNNDEF void matrix_free(Matrix *dest);
 VNNDEF void matrix_print(Matrix src);
 
+// Counter-based initializers, where each value only depends on `seed`, `stream` and its position in `data`,
+// so that a matrix is reproducible from its seed however it's filled, e.g. by any number of threads
+VNNDEF void matrix_uniform(Matrix dest, float low, float high, uint64_t seed, uint64_t stream);
+VNNDEF void matrix_normal(Matrix dest, float mean, float deviation, uint64_t seed, uint64_t stream);
+
 #define MATRIX_AT(src, i, j) (src).data[!(src).transposed ? (i)*(src).cols + (j) : (j)*(src).rows + (i)]
 #define MATRIX_FREED(src) ((src).data == NULL)
 
+// Element-wise operations and transposes can be deferred by building a tree of them, which is then
+// evaluated in a single pass, e.g. `MATRIX_LAZY_SUBTRACT(MATRIX_LAZY(output), MATRIX_LAZY(target))`
+// reads both once and writes the result once, without any matrix in between.
+// NOTE: Nodes are compound literals, so a tree is valid until the end of the block it's built in
+typedef enum {
+	MATRIX_EXPRESSION_LEAF,
+	MATRIX_EXPRESSION_ADD,
+	MATRIX_EXPRESSION_SUBTRACT,
+	MATRIX_EXPRESSION_HADAMARD,	// Element-wise product
+	MATRIX_EXPRESSION_SCALE,
+	MATRIX_EXPRESSION_APPLY,
+	MATRIX_EXPRESSION_TRANSPOSE
+} MatrixOperation;
+
+typedef struct MatrixExpression {
+	MatrixOperation operation;
+	const struct MatrixExpression *lhs, *rhs;	// Where `rhs` is only used by binary operations
+	Matrix leaf;
+	float scalar;
+	float (*func)(float);
+} MatrixExpression;
+
+VNNDEF Matrix matrix_materialize(const MatrixExpression *src);
+VNNDEF void matrix_evaluate(Matrix dest, const MatrixExpression *src);	// NOTE: `dest` may also be a leaf, unless transposed w.r.t. it
+
+#define MATRIX_LAZY(src) (&(MatrixExpression) {.operation = MATRIX_EXPRESSION_LEAF, .leaf = (src)})
+#define MATRIX_LAZY_ADD(a, b) (&(MatrixExpression) {.operation = MATRIX_EXPRESSION_ADD, .lhs = (a), .rhs = (b)})
+#define MATRIX_LAZY_SUBTRACT(a, b) (&(MatrixExpression) {.operation = MATRIX_EXPRESSION_SUBTRACT, .lhs = (a), .rhs = (b)})
+#define MATRIX_LAZY_HADAMARD(a, b) (&(MatrixExpression) {.operation = MATRIX_EXPRESSION_HADAMARD, .lhs = (a), .rhs = (b)})
+#define MATRIX_LAZY_SCALE(a, factor) (&(MatrixExpression) {.operation = MATRIX_EXPRESSION_SCALE, .lhs = (a), .scalar = (factor)})
+#define MATRIX_LAZY_APPLY(a, function) (&(MatrixExpression) {.operation = MATRIX_EXPRESSION_APPLY, .lhs = (a), .func = (function)})
+#define MATRIX_LAZY_TRANSPOSE(a) (&(MatrixExpression) {.operation = MATRIX_EXPRESSION_TRANSPOSE, .lhs = (a)})
+
+// Compressed Sparse Row matrix, where the non-zero values of the $i$-th row
+// are at `values[offsets[i]]` up to `values[offsets[i+1]]` (excluded) and
+// each of them is at the column given by the same index of `columns`
+typedef struct {
+	VNN_DTYPE *values;
+	size_t *columns, *offsets;
+	size_t rows, cols;
+	bool freeable;
+} SparseMatrix;
+
+VNNDEF SparseMatrix sparse_compress(Matrix src);
+VNNDEF SparseMatrix sparse_clone(SparseMatrix src);
+VNNDEF Matrix sparse_multiply(SparseMatrix lhs, Matrix rhs);
+VNNDEF Matrix matrix_multiply_sparse(Matrix lhs, SparseMatrix rhs);
+
+VNNDEF SparseMatrix sparse_from(VNN_DTYPE *values, size_t *columns, size_t *offsets, size_t rows, size_t cols);	// NOTE: `offsets` must have `rows+1` elements
+VNNDEF void sparse_free(SparseMatrix *dest);
+
+#define SPARSE_NONZEROS(src) ((src).offsets[(src).rows] - (src).offsets[0])
+#define SPARSE_FREED(src) ((src).offsets == NULL)
+
+typedef enum {
+	NETWORK_LOSS_MSE,
+	NETWORK_LOSS_CROSS_ENTROPY	// NOTE: Replaces the last activation with a softmax
+} NetworkLoss;
+
+#ifdef VNN_PROFILE
+typedef enum {
+	NETWORK_PHASE_FORWARD,	// Excitations and activations
+	NETWORK_PHASE_DERIVATIVE,	// Derivatives of the activations
+	NETWORK_PHASE_BACKWARD,	// Gradients and their propagation
+	NETWORK_PHASE_UPDATE,
+	NETWORK_PHASES
+} NetworkPhase;
+
+typedef struct {
+	size_t calls, bytes, allocations;
+	double seconds, flops;
+
+	// State of the call in progress
+	bool running;
+	double started;
+	size_t started_bytes, started_allocations;
+} NetworkProfile;
+#endif
+
+typedef enum {
+	NETWORK_INIT_XAVIER,	// Uniform within $\pm\sqrt{6/(n+k)}$ for $n$ inputs and $k$ outputs, e.g. for sigmoids
+	NETWORK_INIT_HE	// Normal with deviation $\sqrt{2/n}$ for $n$ inputs, e.g. for ReLUs
+} NetworkInit;
+
+typedef struct {
+	size_t tag;	// Given along with the weights by `network_evaluator_submit`, e.g. their epoch
+	float loss, accuracy;	// Averaged over the samples
+	bool improved;	// Whether `loss` is the lowest one so far, by `NetworkEvaluator`
+} NetworkEvaluation;
+
 typedef struct {
 	size_t layers;
 	float rate, (**s)(float), (**ds)(float);
+	NetworkLoss loss;
 	Matrix *weights;
 
 	// Epoch relative data
-	Matrix *deltas, *diags, *outputs;
+	Matrix *deltas, *derivatives, *outputs;
+	SparseMatrix *sparse;	// Replaces `outputs[0]` when fed with `network_feed_sparse`
+
+	SparseMatrix *pruned;	// Replaces `weights` in the feed forward step after `network_prune`
+
+#ifdef VNN_PROFILE
+	NetworkProfile *profile;	// At `profile[i*NETWORK_PHASES + p]` is the phase `p` of the weights `i`
+#endif
 } Network;
 
 VNNDEF Network network_new(
 	size_t *shape, size_t layers, float rate,
 	float (**activations)(float), float (**derivatives)(float),
-	float (*rand)(void)
+	float (*rand)(void)	// NOTE: If NULL, the weights are left uninitialized for `network_init`
 );
+VNNDEF void network_init(Network dest, NetworkInit init, uint64_t seed);
 VNNDEF Matrix network_feed(Network dest, Matrix input);
+VNNDEF Matrix network_feed_sparse(Network dest, SparseMatrix input);
+VNNDEF Matrix network_predict(Network dest, Matrix input);	// NOTE: Like `network_feed`, but the result can't be adjusted
+VNNDEF float network_loss(Network src, Matrix target, Matrix gradient);	// NOTE: `gradient` is optional, i.e. may be freed
 VNNDEF float network_error(Network src, Matrix target);
-VNNDEF void network_adjust(Network dest, Matrix target);
+VNNDEF float network_adjust(Network dest, Matrix target);
+VNNDEF float network_threshold(Network src, float ratio);
+VNNDEF float network_prune(Network dest, float threshold);
+VNNDEF NetworkEvaluation network_evaluate(Network src, Matrix inputs, Matrix targets, size_t batch);	// NOTE: Doesn't feed `src`
 VNNDEF void network_free(Network *dest);
 
+#ifdef VNN_PROFILE
+VNNDEF NetworkProfile network_profile(Network src, size_t layer, NetworkPhase phase);
+VNNDEF void network_profile_begin(Network dest, size_t layer, NetworkPhase phase);
+VNNDEF void network_profile_end(Network dest, size_t layer, NetworkPhase phase, double flops);
+VNNDEF void network_profile_reset(Network dest);
+VNNDEF void network_profile_dump(Network src, FILE *stream);
+#endif
+
+#ifdef VNN_THREADS
+typedef struct NetworkRequest {
+	Matrix input, output;	// NOTE: `output` is allocated by the queue, so it must be `matrix_free`d
+
+	// Called from the queue thread when `output` is ready, which gives the request back, e.g. to be freed.
+	// NOTE: Requests with a callback can't be waited for, since they might be gone at any moment
+	void (*callback)(struct NetworkRequest *request);
+	void *data;
+
+	// Managed by the queue, which needs the request until it's done
+	bool done;
+	double submitted;
+	struct NetworkRequest *next;
+} NetworkRequest;
+
+typedef struct {
+	Network network;	// NOTE: Owned by the queue thread until `network_queue_free`
+	size_t batch;
+	double deadline;	// Longest time in seconds a request waits for its batch to fill up
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t pending, completed;
+	NetworkRequest *head, *tail;
+	size_t length;
+	bool stopping;
+
+	// Statistics since the queue started, where at `histogram[i]` is the number of batches of `i+1`
+	// requests and latencies are summed up, in seconds, until the batch is fed and until it's done
+	size_t requests, batches, *histogram;
+	double started, waited, waited_max, served;
+} NetworkQueue;
+
+VNNDEF NetworkQueue *network_queue_new(Network src, size_t batch, double deadline);
+VNNDEF void network_queue_submit(NetworkQueue *dest, NetworkRequest *request);
+VNNDEF Matrix network_queue_wait(NetworkQueue *dest, NetworkRequest *request);
+VNNDEF Matrix network_queue_infer(NetworkQueue *dest, Matrix input);
+VNNDEF void network_queue_dump(NetworkQueue *src, FILE *stream);
+VNNDEF void network_queue_free(NetworkQueue *dest);
+
+typedef struct {
+	Network snapshot;	// Copy of the weights under evaluation, while `buffer` takes the next ones
+	Matrix *buffer;
+	Matrix inputs, targets;	// NOTE: Not copied, so they must outlive the evaluator
+	size_t batch, patience;	// Evaluations without improvement before stopping, if not 0
+	bool (*hook)(NetworkEvaluation result, void *data);	// Called from the evaluator thread, returns whether to stop
+	void *data;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t submitted, evaluated;
+	size_t tag;
+	bool pending, busy, stopping, stopped;
+
+	// Results so far, with how many evaluations went by since the best one
+	NetworkEvaluation last, best;
+	size_t evaluations, stale;
+} NetworkEvaluator;
+
+VNNDEF NetworkEvaluator *network_evaluator_new(
+	Network src, Matrix inputs, Matrix targets, size_t batch, size_t patience,
+	bool (*hook)(NetworkEvaluation result, void *data), void *data
+);
+VNNDEF void network_evaluator_submit(NetworkEvaluator *dest, Network src, size_t tag);	// NOTE: Replaces any weights still waiting
+VNNDEF bool network_evaluator_stopped(NetworkEvaluator *src);
+VNNDEF NetworkEvaluation network_evaluator_wait(NetworkEvaluator *dest);
+VNNDEF void network_evaluator_free(NetworkEvaluator *dest);
+#endif
+
 #define NETWORK_FREED(src) ((src).layers == 0)
 
+// Generates `name##_feed` and `name##_adjust`, which behave as `network_predict` and `network_feed`
+// followed by `network_adjust` on a single sample, for a network whose shape `{inputs, hidden, outputs}`
+// and activations `s` with derivatives `ds` are known at compile time. Since the weights share the layout
+// of a `Network`, e.g. `nn.weights` can be passed, the same weights can be used by either of them.
+// Nothing is allocated and all the loops have constant bounds, so that an optimizing compiler can unroll
+// them and inline the activations, which makes them fit for tiny networks evaluated over and over.
+// NOTE: Values in between the layers are kept as `float`, unlike in `network_feed`
+#define NETWORK_SPECIALIZE(name, inputs, hidden, outputs, s, ds, loss) \
+	VNNDEF void name##_propagate( \
+		const Matrix *weights, const VNN_DTYPE *input, \
+		float *between, float *result, float *between_derivatives, float *result_derivatives \
+	) { \
+		assert(weights[0].rows == (inputs)+1 && weights[0].cols == (hidden) && !weights[0].transposed); \
+		assert(weights[1].rows == (hidden)+1 && weights[1].cols == (outputs) && !weights[1].transposed); \
+		\
+		/* Biases are added last, as the inputs extended with 1 would do in `matrix_multiply` */ \
+		for (size_t j = 0; j < (hidden); j++) { \
+			float sum = 0; \
+			for (size_t i = 0; i < (inputs); i++) { \
+				sum += VNN_DTYPE_TO_FLOAT(input[i]) * VNN_DTYPE_TO_FLOAT(weights[0].data[i*(hidden) + j]); \
+			} \
+			sum += VNN_DTYPE_TO_FLOAT(weights[0].data[(inputs)*(hidden) + j]); \
+			\
+			between[j] = s(sum); \
+			if (between_derivatives != NULL) { \
+				between_derivatives[j] = ds(sum); \
+			} \
+		} \
+		\
+		float max = -INFINITY, total = 0; \
+		for (size_t j = 0; j < (outputs); j++) { \
+			float sum = 0; \
+			for (size_t i = 0; i < (hidden); i++) { \
+				sum += between[i] * VNN_DTYPE_TO_FLOAT(weights[1].data[i*(outputs) + j]); \
+			} \
+			sum += VNN_DTYPE_TO_FLOAT(weights[1].data[(hidden)*(outputs) + j]); \
+			\
+			result[j] = sum; \
+			if (sum > max) { \
+				max = sum; \
+			} \
+		} \
+		for (size_t j = 0; j < (outputs); j++) { \
+			if ((loss) == NETWORK_LOSS_CROSS_ENTROPY) { \
+				result[j] = expf(result[j] - max); \
+				total += result[j]; \
+				continue; \
+			} \
+			\
+			if (result_derivatives != NULL) { \
+				result_derivatives[j] = ds(result[j]); \
+			} \
+			result[j] = s(result[j]); \
+		} \
+		for (size_t j = 0; (loss) == NETWORK_LOSS_CROSS_ENTROPY && j < (outputs); j++) { \
+			result[j] /= total; \
+		} \
+	} \
+	\
+	VNNDEF void name##_feed(const Matrix *weights, const VNN_DTYPE *input, VNN_DTYPE *output) { \
+		float between[(hidden)], result[(outputs)]; \
+		name##_propagate(weights, input, between, result, NULL, NULL); \
+		for (size_t j = 0; j < (outputs); j++) { \
+			output[j] = VNN_DTYPE_FROM_FLOAT(result[j]); \
+		} \
+	} \
+	\
+	VNNDEF float name##_adjust(Matrix *weights, float rate, const VNN_DTYPE *input, const VNN_DTYPE *target) { \
+		float between[(hidden)], result[(outputs)], between_derivatives[(hidden)], result_derivatives[(outputs)]; \
+		name##_propagate(weights, input, between, result, between_derivatives, result_derivatives); \
+		\
+		/* Same steps as `network_loss` and `network_adjust`, with all the gradients taken before any update */ \
+		float error = 0, to_result[(outputs)], to_between[(hidden)]; \
+		for (size_t j = 0; j < (outputs); j++) { \
+			float o = result[j], t = VNN_DTYPE_TO_FLOAT(target[j]); \
+			if ((loss) == NETWORK_LOSS_CROSS_ENTROPY) { \
+				error -= t * logf(o > 1e-7 ? o : 1e-7); \
+				to_result[j] = o - t; \
+			} else { \
+				error += (o - t)*(o - t) / 2.0; \
+				to_result[j] = (o - t) * result_derivatives[j]; \
+			} \
+		} \
+		for (size_t i = 0; i < (hidden); i++) { \
+			float sum = 0; \
+			for (size_t j = 0; j < (outputs); j++) { \
+				sum += to_result[j] * VNN_DTYPE_TO_FLOAT(weights[1].data[i*(outputs) + j]); \
+			} \
+			to_between[i] = sum * between_derivatives[i]; \
+		} \
+		\
+		for (size_t i = 0; i <= (hidden); i++) { \
+			float value = i < (hidden) ? between[i] : 1; \
+			for (size_t j = 0; j < (outputs); j++) { \
+				VNN_DTYPE *weight = &weights[1].data[i*(outputs) + j]; \
+				*weight = VNN_DTYPE_FROM_FLOAT(VNN_DTYPE_TO_FLOAT(*weight) + value * to_result[j] * -rate); \
+			} \
+		} \
+		for (size_t i = 0; i <= (inputs); i++) { \
+			float value = i < (inputs) ? VNN_DTYPE_TO_FLOAT(input[i]) : 1; \
+			for (size_t j = 0; j < (hidden); j++) { \
+				VNN_DTYPE *weight = &weights[0].data[i*(hidden) + j]; \
+				*weight = VNN_DTYPE_FROM_FLOAT(VNN_DTYPE_TO_FLOAT(*weight) + value * to_between[j] * -rate); \
+			} \
+		} \
+		\
+		return error; \
+	}
+
 VNNDEF Matrix matrix_empty(size_t rows, size_t cols) {
 	assert(rows > 0 && cols > 0);
 
 	return (Matrix) {
-		.data = VNN_MALLOC(rows*cols * sizeof(VNN_DTYPE)),
+		.data = VNN_ALLOC(rows*cols * sizeof(VNN_DTYPE)),
 		.rows = rows, .cols = cols,
 		.transposed = false, .freeable = true
 	};
@@ -149,36 +509,112 @@ VNNDEF Matrix matrix_resize(Matrix src, size_t rows, size_t cols, float extend)
 
 VNNDEF Matrix matrix_add(Matrix lhs, Matrix rhs) {
 	assert(lhs.rows == rhs.rows && lhs.cols == rhs.cols);
+	return matrix_materialize(MATRIX_LAZY_ADD(MATRIX_LAZY(lhs), MATRIX_LAZY(rhs)));
+}
 
-	Matrix dest = matrix_empty(lhs.rows, lhs.cols);
+VNNDEF void matrix_multiply_transposed(Matrix dest, Matrix lhs, Matrix rhs, float scale) {	// Same as `matrix_multiply_into`, for a transposed `rhs`
+	assert(lhs.cols == rhs.rows && rhs.transposed);
+
+	// Columns of a transposed matrix are contiguous, so each value of the result is the dot product
+	// of a row of `lhs`, gathered once, and a column of `rhs`, rather than striding across its rows.
+	// Four columns are summed at once, each in the same order as `matrix_multiply` would.
+	// The gathered row fits on the stack unless it's wide, in which case it's allocated once for all rows
+	float scratch[VNN_SCRATCH];
+	float *row = lhs.cols <= VNN_SCRATCH ? scratch : VNN_ALLOC(lhs.cols * sizeof(float));
 	for (size_t i = 0; i < lhs.rows; i++) {
-		for (size_t j = 0; j < lhs.cols; j++) {
-			MATRIX_AT(dest, i, j) = VNN_DTYPE_FROM_FLOAT(
-				VNN_DTYPE_TO_FLOAT(MATRIX_AT(lhs, i, j)) +
-				VNN_DTYPE_TO_FLOAT(MATRIX_AT(rhs, i, j))
-			);
+		for (size_t k = 0; k < lhs.cols; k++) {
+			row[k] = VNN_DTYPE_TO_FLOAT(MATRIX_AT(lhs, i, k));
+		}
+
+		size_t j = 0;
+		for (; j+4 <= rhs.cols; j += 4) {
+			VNN_DTYPE *first = &rhs.data[j*rhs.rows], *second = &first[rhs.rows], *third = &second[rhs.rows], *fourth = &third[rhs.rows];
+			float sums[4] = {0};
+			for (size_t k = 0; k < lhs.cols; k++) {
+				sums[0] += row[k] * VNN_DTYPE_TO_FLOAT(first[k]);
+				sums[1] += row[k] * VNN_DTYPE_TO_FLOAT(second[k]);
+				sums[2] += row[k] * VNN_DTYPE_TO_FLOAT(third[k]);
+				sums[3] += row[k] * VNN_DTYPE_TO_FLOAT(fourth[k]);
+			}
+			for (size_t l = 0; l < 4; l++) {
+				MATRIX_AT(dest, i, j+l) = VNN_DTYPE_FROM_FLOAT(scale * sums[l]);
+			}
+		}
+		for (; j < rhs.cols; j++) {
+			VNN_DTYPE *column = &rhs.data[j*rhs.rows];
+			float sum = 0;
+			for (size_t k = 0; k < lhs.cols; k++) {
+				sum += row[k] * VNN_DTYPE_TO_FLOAT(column[k]);
+			}
+			MATRIX_AT(dest, i, j) = VNN_DTYPE_FROM_FLOAT(scale * sum);
 		}
 	}
-	return dest;
+
+	if (row != scratch) {
+		VNN_FREE(row);
+	}
 }
 
 VNNDEF Matrix matrix_multiply(Matrix lhs, Matrix rhs) {
-	assert(lhs.cols == rhs.rows);
-
 	Matrix dest = matrix_empty(lhs.rows, rhs.cols);
-	for (size_t i = 0; i < lhs.rows; i++) {
-		for (size_t j = 0; j < rhs.cols; j++) {
-			float sum = 0;
-			for (size_t k = 0; k < lhs.cols; k++) {
-				sum += (
-					VNN_DTYPE_TO_FLOAT(MATRIX_AT(lhs, i, k)) *
-					VNN_DTYPE_TO_FLOAT(MATRIX_AT(rhs, k, j))
-				);
+	matrix_multiply_into(dest, lhs, rhs, 1);
+	return dest;
+}
+
+// Product scaled while it's written, into an existing matrix, e.g. to reuse it across steps
+VNNDEF void matrix_multiply_into(Matrix dest, Matrix lhs, Matrix rhs, float scale) {
+	assert(lhs.cols == rhs.rows && dest.rows == lhs.rows && dest.cols == rhs.cols);
+	assert(dest.data != lhs.data && dest.data != rhs.data);
+	if (rhs.transposed) {
+		matrix_multiply_transposed(dest, lhs, rhs, scale);
+		return;
+	}
+
+	// Rows of the result are accumulated four at a time, so that the rows of `rhs` are read sequentially
+	// and each of their values is reused across the rows of `lhs`, i.e. a batch costs less than its samples.
+	// Sums only need as many rows as `lhs` has, so that a single sample of a small layer fits on the stack
+	size_t height = lhs.rows < 4 ? lhs.rows : 4;
+	float scratch[VNN_SCRATCH];
+	float *sums = height*rhs.cols <= VNN_SCRATCH ? scratch : VNN_ALLOC(height*rhs.cols * sizeof(float));
+	for (size_t i = 0; i < lhs.rows; i += 4) {
+		size_t rows = lhs.rows - i < 4 ? lhs.rows - i : 4;
+		memset(sums, 0, rows*rhs.cols * sizeof(float));
+
+		for (size_t k = 0; k < lhs.cols; k++) {
+			float values[4] = {0};
+			for (size_t l = 0; l < rows; l++) {
+				values[l] = VNN_DTYPE_TO_FLOAT(MATRIX_AT(lhs, i+l, k));
+			}
+
+			VNN_DTYPE *row = &rhs.data[k*rhs.cols];	// Plain indexing lets the compiler vectorize
+			if (rows == 4) {
+				float *first = sums, *second = &sums[rhs.cols], *third = &sums[2*rhs.cols], *fourth = &sums[3*rhs.cols];
+				for (size_t j = 0; j < rhs.cols; j++) {
+					float value = VNN_DTYPE_TO_FLOAT(row[j]);
+					first[j] += values[0] * value;
+					second[j] += values[1] * value;
+					third[j] += values[2] * value;
+					fourth[j] += values[3] * value;
+				}
+			} else {
+				for (size_t l = 0; l < rows; l++) {
+					for (size_t j = 0; j < rhs.cols; j++) {
+						sums[l*rhs.cols + j] += values[l] * VNN_DTYPE_TO_FLOAT(row[j]);
+					}
+				}
+			}
+		}
+
+		for (size_t l = 0; l < rows; l++) {
+			for (size_t j = 0; j < rhs.cols; j++) {
+				MATRIX_AT(dest, i+l, j) = VNN_DTYPE_FROM_FLOAT(scale * sums[l*rhs.cols + j]);
 			}
-			MATRIX_AT(dest, i, j) = VNN_DTYPE_FROM_FLOAT(sum);
 		}
 	}
-	return dest;
+
+	if (sums != scratch) {
+		VNN_FREE(sums);
+	}
 }
 
 VNNDEF void matrix_add_scalar(Matrix dest, float scalar) {
@@ -254,196 +690,1622 @@ VNNDEF void matrix_print(Matrix src) {
 	printf("}\n");
 }
 
-VNNDEF Network network_new(
-	size_t *shape, size_t layers, float rate,
-	float (**activations)(float), float (**derivatives)(float),
-	float (*rand)(void)
-) {
-	assert(shape != NULL && shape[0] > 0 && layers >= 2);
-	assert(activations != NULL && derivatives != NULL && rand != NULL);
+VNNDEF void matrix_expression_shape(const MatrixExpression *src, size_t *rows, size_t *cols) {
+	assert(src != NULL);
+
+	size_t other_rows, other_cols;
+	switch (src->operation) {
+		case MATRIX_EXPRESSION_LEAF:
+			assert(!MATRIX_FREED(src->leaf));
+			*rows = src->leaf.rows;
+			*cols = src->leaf.cols;
+			break;
+
+		case MATRIX_EXPRESSION_ADD:
+		case MATRIX_EXPRESSION_SUBTRACT:
+		case MATRIX_EXPRESSION_HADAMARD:
+			matrix_expression_shape(src->lhs, rows, cols);
+			matrix_expression_shape(src->rhs, &other_rows, &other_cols);
+			assert(*rows == other_rows && *cols == other_cols);
+			break;
+
+		case MATRIX_EXPRESSION_TRANSPOSE:
+			matrix_expression_shape(src->lhs, cols, rows);
+			break;
+
+		default:
+			assert(src->operation != MATRIX_EXPRESSION_APPLY || src->func != NULL);
+			matrix_expression_shape(src->lhs, rows, cols);
+	}
+}
 
-	size_t betweens = (layers-1) * sizeof(Matrix);
-	Network dest = {
-		.layers = layers, .rate = rate,
-		.s = activations, .ds = derivatives,
-		.weights = VNN_MALLOC(betweens),
+#define MATRIX_EXPRESSION_CHUNK 64
 
-		.deltas = VNN_CALLOC(betweens),
-		.diags = VNN_CALLOC(betweens),	// At `diags[0]` are the diagonalized derivatives of the 2nd layer
-		.outputs = VNN_CALLOC(1*sizeof(Matrix) + betweens)	// At `outputs[0]` is the extended input vector
-	};
+// Evaluates `length` (up to `MATRIX_EXPRESSION_CHUNK`) consecutive elements of a row of `src` starting from the
+// $j$-th column, where transposes are pushed down to the leaves since they commute with element-wise operations
+VNNDEF void matrix_expression_row(const MatrixExpression *src, size_t i, size_t j, size_t length, bool transposed, float *dest) {
+	float operand[MATRIX_EXPRESSION_CHUNK];
 
-	for (size_t i = 0; i < layers-1; i++) {
-		assert(activations[i] != NULL && derivatives[i] != NULL);
+	switch (src->operation) {
+		case MATRIX_EXPRESSION_LEAF:
+			if (!transposed && !src->leaf.transposed) {
+				VNN_DTYPE *row = &src->leaf.data[i*src->leaf.cols + j];
+				for (size_t k = 0; k < length; k++) {
+					dest[k] = VNN_DTYPE_TO_FLOAT(row[k]);
+				}
+			} else {
+				for (size_t k = 0; k < length; k++) {
+					dest[k] = VNN_DTYPE_TO_FLOAT(!transposed ? MATRIX_AT(src->leaf, i, j+k) : MATRIX_AT(src->leaf, j+k, i));
+				}
+			}
+			break;
 
-		// Matrices are shaped $(n+1) \times k$ where $n$ is the number of the previous layer units,
-		// extended to include the biases and $k$ is the number of the next layer units.
-		// Each weight $w_{ij}$ at the $i$-th row and $j$-th column is the connection between the $i$-th
-		// unit of the previous layer and the $j$-th unit of the next one (see Section 7.3.1, p. 165)
-		dest.weights[i] = matrix_rand(shape[i]+1, shape[i+1], rand);
-	}
+		case MATRIX_EXPRESSION_ADD:
+			matrix_expression_row(src->lhs, i, j, length, transposed, dest);
+			matrix_expression_row(src->rhs, i, j, length, transposed, operand);
+			for (size_t k = 0; k < length; k++) {
+				dest[k] += operand[k];
+			}
+			break;
 
-	return dest;
+		case MATRIX_EXPRESSION_SUBTRACT:
+			matrix_expression_row(src->lhs, i, j, length, transposed, dest);
+			matrix_expression_row(src->rhs, i, j, length, transposed, operand);
+			for (size_t k = 0; k < length; k++) {
+				dest[k] -= operand[k];
+			}
+			break;
+
+		case MATRIX_EXPRESSION_HADAMARD:
+			matrix_expression_row(src->lhs, i, j, length, transposed, dest);
+			matrix_expression_row(src->rhs, i, j, length, transposed, operand);
+			for (size_t k = 0; k < length; k++) {
+				dest[k] *= operand[k];
+			}
+			break;
+
+		case MATRIX_EXPRESSION_SCALE:
+			matrix_expression_row(src->lhs, i, j, length, transposed, dest);
+			for (size_t k = 0; k < length; k++) {
+				dest[k] *= src->scalar;
+			}
+			break;
+
+		case MATRIX_EXPRESSION_APPLY:
+			matrix_expression_row(src->lhs, i, j, length, transposed, dest);
+			for (size_t k = 0; k < length; k++) {
+				dest[k] = src->func(dest[k]);
+			}
+			break;
+
+		case MATRIX_EXPRESSION_TRANSPOSE:
+			matrix_expression_row(src->lhs, i, j, length, !transposed, dest);
+			break;
+
+		default:
+			assert(false && "Unknown operation");
+	}
 }
 
-VNNDEF Matrix network_feed(Network dest, Matrix input) {
-	assert(!NETWORK_FREED(dest));
-	assert(input.rows == 1 && input.cols == dest.weights[0].rows-1);
+// Whether every leaf stores its values in the same order as a result stored by columns, if `transposed`, or by rows,
+// so that any value of the result and the ones it's computed from are at the same index of their data
+VNNDEF bool matrix_expression_flat(const MatrixExpression *src, bool transposed) {
+	switch (src->operation) {
+		case MATRIX_EXPRESSION_LEAF:
+			return src->leaf.transposed == transposed;
 
-	if (!MATRIX_FREED(dest.outputs[0])) {
-		matrix_free(&dest.outputs[0]);
+		case MATRIX_EXPRESSION_ADD:
+		case MATRIX_EXPRESSION_SUBTRACT:
+		case MATRIX_EXPRESSION_HADAMARD:
+			return matrix_expression_flat(src->lhs, transposed) && matrix_expression_flat(src->rhs, transposed);
+
+		case MATRIX_EXPRESSION_TRANSPOSE:
+			return matrix_expression_flat(src->lhs, !transposed);
+
+		default:
+			return matrix_expression_flat(src->lhs, transposed);
 	}
-	dest.outputs[0] = matrix_resize(input, input.rows, input.cols+1, 1);	// Extend input with bias
+}
 
-	for (size_t i = 1; i < dest.layers; i++) {
-		if (!MATRIX_FREED(dest.outputs[i])) {
-			matrix_free(&dest.outputs[i]);
+// Loops of flat expressions go over whole chunks, with the rest of a shorter one zeroed, since GCC only vectorizes
+// loops of a constant length at -O2. Copies between the data and the chunks are kept out of the recursion, where
+// GCC would otherwise need a runtime alias check despite `restrict`, and they can't alias as `dest` is never a leaf
+VNNDEF void matrix_expression_load(const VNN_DTYPE *restrict src, size_t length, float *restrict dest) {
+	if (length == MATRIX_EXPRESSION_CHUNK) {
+		for (size_t k = 0; k < MATRIX_EXPRESSION_CHUNK; k++) {
+			dest[k] = VNN_DTYPE_TO_FLOAT(src[k]);
 		}
-		if (!MATRIX_FREED(dest.diags[i-1])) {
-			matrix_free(&dest.diags[i-1]);
+	} else {
+		for (size_t k = 0; k < length; k++) {
+			dest[k] = VNN_DTYPE_TO_FLOAT(src[k]);
 		}
+		memset(&dest[length], 0, (MATRIX_EXPRESSION_CHUNK - length) * sizeof(float));
+	}
+}
 
-		// Computes the excitation, i.e. weighted sum, of the inputs
-		// (see Section 6.1.1, p. 125 and Section 7.3.1, p. 165)
-		Matrix excitations = matrix_multiply(dest.outputs[i-1], dest.weights[i-1]);
+VNNDEF void matrix_expression_store(const float *restrict src, size_t length, VNN_DTYPE *restrict dest) {
+	if (length == MATRIX_EXPRESSION_CHUNK) {
+		for (size_t k = 0; k < MATRIX_EXPRESSION_CHUNK; k++) {
+			dest[k] = VNN_DTYPE_FROM_FLOAT(src[k]);
+		}
+	} else {
+		for (size_t k = 0; k < length; k++) {
+			dest[k] = VNN_DTYPE_FROM_FLOAT(src[k]);
+		}
+	}
+}
 
-		// Unit is considered active when its activation, given by the function $s(x)$ where $x$ is the
-		// excitation, is greater than a given threshold, i.e. the bias (see Figure 3.5, p. 61)
-		Matrix activated = matrix_resize(excitations, excitations.rows, excitations.cols+1, 1);
-		matrix_apply(activated, dest.s[i-1]);
-		MATRIX_AT(activated, 0, activated.cols-1) = VNN_DTYPE_FROM_FLOAT(1);	// NOTE: Technically the bias input doesn't have to be 1; TODO: Actually try to remove this line
-		dest.outputs[i] = activated;
+// Evaluates `length` (up to `MATRIX_EXPRESSION_CHUNK`) values of a flat `src` starting from the index `offset` of the
+// data of its leaves
+VNNDEF void matrix_expression_chunk(const MatrixExpression *src, size_t offset, size_t length, float *restrict dest) {
+	float operand[MATRIX_EXPRESSION_CHUNK];
+
+	switch (src->operation) {
+		case MATRIX_EXPRESSION_LEAF:
+			matrix_expression_load(&src->leaf.data[offset], length, dest);
+			break;
+
+		case MATRIX_EXPRESSION_ADD:
+			matrix_expression_chunk(src->lhs, offset, length, dest);
+			matrix_expression_chunk(src->rhs, offset, length, operand);
+			for (size_t k = 0; k < MATRIX_EXPRESSION_CHUNK; k++) {
+				dest[k] += operand[k];
+			}
+			break;
 
-		// Diagonalized derivatives are stored during the feed forward step so that
-		// we don't have to recompute the excitations (see Section 7.2.2, p. 157)
-		matrix_apply(excitations, dest.ds[i-1]);	// No need to clone since we don't need `excitations` anymore
-		dest.diags[i-1] = matrix_diagonalize(excitations);
+		case MATRIX_EXPRESSION_SUBTRACT:
+			matrix_expression_chunk(src->lhs, offset, length, dest);
+			matrix_expression_chunk(src->rhs, offset, length, operand);
+			for (size_t k = 0; k < MATRIX_EXPRESSION_CHUNK; k++) {
+				dest[k] -= operand[k];
+			}
+			break;
 
-		matrix_free(&excitations);
-	}
+		case MATRIX_EXPRESSION_HADAMARD:
+			matrix_expression_chunk(src->lhs, offset, length, dest);
+			matrix_expression_chunk(src->rhs, offset, length, operand);
+			for (size_t k = 0; k < MATRIX_EXPRESSION_CHUNK; k++) {
+				dest[k] *= operand[k];
+			}
+			break;
 
-	Matrix output = dest.outputs[dest.layers-1];
-	output.cols--;
-	output.freeable = false;
-	return output;
-}
+		case MATRIX_EXPRESSION_SCALE: {
+			float scalar = src->scalar;	// Read once, as it could otherwise be written through `dest`
+			matrix_expression_chunk(src->lhs, offset, length, dest);
+			for (size_t k = 0; k < MATRIX_EXPRESSION_CHUNK; k++) {
+				dest[k] *= scalar;
+			}
+			break;
+		}
 
-VNNDEF float network_error(Network src, Matrix target) {
-	assert(!NETWORK_FREED(src) && !MATRIX_FREED(src.diags[0]));
+		case MATRIX_EXPRESSION_APPLY:
+			matrix_expression_chunk(src->lhs, offset, length, dest);
+			for (size_t k = 0; k < length; k++) {	// Not for the zeros, which `func` might not accept
+				dest[k] = src->func(dest[k]);
+			}
+			break;
 
-	Matrix output = src.outputs[src.layers-1];
-	output.cols--;
+		case MATRIX_EXPRESSION_TRANSPOSE:	// Already accounted for by `matrix_expression_flat`
+			matrix_expression_chunk(src->lhs, offset, length, dest);
+			break;
+
+		default:
+			assert(false && "Unknown operation");
+	}
+}
 
-	// On-line (see Section 7.3.2, p. 170) evaluation of the Mean Squared Error as
-	// $\frac{1}{2}\|o_i - t_i\|^2$ (see Section 7.2.1, p. 156) for the $i$-th dataset sample
-	matrix_negate(target);
-	Matrix diff = matrix_add(output, target);
-	matrix_negate(target);	// Better not have `target` changing every epoch :)
+VNNDEF void matrix_evaluate(Matrix dest, const MatrixExpression *src) {
+	assert(!MATRIX_FREED(dest));
+
+	// An operation between two leaves stored like `dest`, the most common expression, e.g. `weights + deltas`,
+	// is a plain loop over their data, without walking the tree nor paying for any chunk on small matrices
+	MatrixOperation operation = src->operation;
+	if (
+		(operation == MATRIX_EXPRESSION_ADD || operation == MATRIX_EXPRESSION_SUBTRACT || operation == MATRIX_EXPRESSION_HADAMARD) &&
+		src->lhs->operation == MATRIX_EXPRESSION_LEAF && src->rhs->operation == MATRIX_EXPRESSION_LEAF &&
+		src->lhs->leaf.transposed == dest.transposed && src->rhs->leaf.transposed == dest.transposed
+	) {
+		Matrix lhs = src->lhs->leaf, rhs = src->rhs->leaf;
+		assert(!MATRIX_FREED(lhs) && !MATRIX_FREED(rhs));
+		assert(lhs.rows == dest.rows && lhs.cols == dest.cols && rhs.rows == dest.rows && rhs.cols == dest.cols);
+
+		size_t size = dest.rows*dest.cols;
+		if (operation == MATRIX_EXPRESSION_ADD) {
+			for (size_t n = 0; n < size; n++) {
+				dest.data[n] = VNN_DTYPE_FROM_FLOAT(VNN_DTYPE_TO_FLOAT(lhs.data[n]) + VNN_DTYPE_TO_FLOAT(rhs.data[n]));
+			}
+		} else if (operation == MATRIX_EXPRESSION_SUBTRACT) {
+			for (size_t n = 0; n < size; n++) {
+				dest.data[n] = VNN_DTYPE_FROM_FLOAT(VNN_DTYPE_TO_FLOAT(lhs.data[n]) - VNN_DTYPE_TO_FLOAT(rhs.data[n]));
+			}
+		} else {
+			for (size_t n = 0; n < size; n++) {
+				dest.data[n] = VNN_DTYPE_FROM_FLOAT(VNN_DTYPE_TO_FLOAT(lhs.data[n]) * VNN_DTYPE_TO_FLOAT(rhs.data[n]));
+			}
+		}
+		return;
+	}
 
-	float squares = 0;	// Stores the norm of `diff` squared
-	for (size_t i = 0; i < diff.rows*diff.cols; i++) {
-		squares += VNN_DTYPE_TO_FLOAT(diff.data[i]) * VNN_DTYPE_TO_FLOAT(diff.data[i]);
+	size_t rows, cols;
+	matrix_expression_shape(src, &rows, &cols);
+	assert(dest.rows == rows && dest.cols == cols);
+
+	// Each chunk is read from every leaf before being written, which is what allows
+	// `dest` to be one of the leaves, as long as it's read at the same positions
+	float chunk[MATRIX_EXPRESSION_CHUNK];
+
+	// When no leaf is transposed w.r.t. the result, the data of all of them is walked straight through,
+	// regardless of the rows, as a plain loop would
+	if (matrix_expression_flat(src, dest.transposed)) {
+		for (size_t n = 0; n < rows*cols; n += MATRIX_EXPRESSION_CHUNK) {
+			size_t length = rows*cols - n < MATRIX_EXPRESSION_CHUNK ? rows*cols - n : MATRIX_EXPRESSION_CHUNK;
+			matrix_expression_chunk(src, n, length, chunk);
+			matrix_expression_store(chunk, length, &dest.data[n]);
+		}
+		return;
 	}
 
-	float error = squares / 2.0;	// Derivative cancels 2 out
+	for (size_t i = 0; i < rows; i++) {
+		for (size_t j = 0; j < cols; j += MATRIX_EXPRESSION_CHUNK) {
+			size_t length = cols - j < MATRIX_EXPRESSION_CHUNK ? cols - j : MATRIX_EXPRESSION_CHUNK;
+			matrix_expression_row(src, i, j, length, false, chunk);
 
-	matrix_free(&diff);
-	return error;
+			for (size_t k = 0; k < length; k++) {
+				MATRIX_AT(dest, i, j+k) = VNN_DTYPE_FROM_FLOAT(chunk[k]);
+			}
+		}
+	}
 }
 
-VNNDEF void network_adjust(Network dest, Matrix target) {
-	assert(!NETWORK_FREED(dest) && !MATRIX_FREED(dest.diags[0]));
-	assert(target.rows == 1 && target.cols == dest.weights[dest.layers-2].cols);
+VNNDEF Matrix matrix_materialize(const MatrixExpression *src) {
+	size_t rows, cols;
+	matrix_expression_shape(src, &rows, &cols);
 
-	// NOTE:
-	// Grasping the results of the operations might be easier by commenting on each line the inputs
-	// and output shape, e.g. `delta` on the first iteration would be "2x1 . 1x4 = 2x4" for a network
-	// of shape `{2, 3, 2}` since `to_units_derivative` is "(1x2 . 2x2)T = 1x2T = 2x1", where "1x2"
-	// is the `to_error_derivative` and "2x2" is the last diagonalized derivative
+	Matrix dest = matrix_empty(rows, cols);
+	matrix_evaluate(dest, src);
+	return dest;
+}
 
-	Matrix output = dest.outputs[dest.layers-1];
-	output.cols--;
+#define VNN_PHILOX_LANES 8
+
+// Philox4x32-10 (see Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3", 2011) of the
+// `VNN_PHILOX_LANES` counters following `block`, interleaved by word so that the rounds vectorize
+VNNDEF void vnn_philox(uint64_t block, uint64_t seed, uint64_t stream, uint32_t dest[4][VNN_PHILOX_LANES]) {
+	uint32_t key[2] = {(uint32_t) seed, (uint32_t) (seed >> 32)};
+	for (size_t l = 0; l < VNN_PHILOX_LANES; l++) {
+		dest[0][l] = (uint32_t) (block + l);
+		dest[1][l] = (uint32_t) ((block + l) >> 32);
+		dest[2][l] = (uint32_t) stream;
+		dest[3][l] = (uint32_t) (stream >> 32);
+	}
 
-	// Derivative of the Mean Squared Error (see Section 7.3.3, p. 171)
-	matrix_negate(target);
-	Matrix to_error_derivative = matrix_add(output, target);
-	matrix_negate(target);
+	for (size_t round = 0; round < 10; round++) {
+		for (size_t l = 0; l < VNN_PHILOX_LANES; l++) {
+			uint64_t first = (uint64_t) 0xD2511F53 * dest[0][l], second = (uint64_t) 0xCD9E8D57 * dest[2][l];
+			uint32_t odd = dest[1][l], last = dest[3][l];
 
-	// Derivative up to the network outputs (see Section 7.3.3, p. 171)
-	Matrix to_units_derivative = matrix_multiply(to_error_derivative, dest.diags[dest.layers-2]);
-	matrix_transpose(&to_units_derivative);
-	for (size_t i = dest.layers-1; i > 0; i--) {
-		if (!MATRIX_FREED(dest.deltas[i-1])) {
-			matrix_free(&dest.deltas[i-1]);
+			dest[0][l] = (uint32_t) (second >> 32) ^ odd ^ key[0];
+			dest[1][l] = (uint32_t) second;
+			dest[2][l] = (uint32_t) (first >> 32) ^ last ^ key[1];
+			dest[3][l] = (uint32_t) first;
 		}
+		key[0] += 0x9E3779B9;
+		key[1] += 0xBB67AE85;
+	}
+}
 
-		// Direction of steepest descent (from weights gradient; see Section 7.1.1, p. 151)
-		// on the error function, w.r.t. the weights between the previous and next layer,
-		// is given by the inputs times the derivative until the next layer, because the
-		// derivation need not propagate further as current weights don't influence previous
-		// layers. E.g. $\frac{\partial}{\partial w}s(i \cdot w) = s'(i \cdot w) \cdot i$
-		// shows how the last step of the chain rule is to multiply by the constant $i$.
-		Matrix delta = matrix_multiply(to_units_derivative, dest.outputs[i-1]);
-		dest.deltas[i-1] = delta;
-
-		if (i > 1) {	// No need to propagate to the inputs, since they don't have any derivative
+#ifdef VNN_THREADS
 
-			// Derivatives w.r.t. any of the previous layers weights don't depend on the next layer
-			// biases, since they have no effect on the gradient of the previous layer weights and
-			// they have no connection to the previous layers (see Section 7.3.3, p. 170)
-			Matrix without_bias = dest.weights[i-1];
-			without_bias.rows--;
+// Runs `func` on each of the first `workers` of the `slices`, of `size` bytes each, where the first one is run by the
+// calling thread and the others by a thread of their own, or also by the calling one if their thread couldn't start
+VNNDEF void vnn_parallel(void *(*func)(void *), void *slices, size_t size, size_t workers) {
+	assert(workers > 0 && workers <= VNN_WORKERS);
 
-			// Propagate the derivative to the previous layer units (see Section 7.3.3, p. 171)
-			Matrix to_weights_derivative = matrix_multiply(without_bias, to_units_derivative);
-			matrix_free(&to_units_derivative);
-			to_units_derivative = matrix_multiply(dest.diags[i-2], to_weights_derivative);
-			matrix_free(&to_weights_derivative);
+	pthread_t threads[VNN_WORKERS];
+	bool started[VNN_WORKERS] = {false};
+	for (size_t w = 1; w < workers; w++) {
+		void *slice = (char *) slices + w*size;
+		started[w] = pthread_create(&threads[w], NULL, func, slice) == 0;
+		if (!started[w]) {
+			func(slice);
 		}
 	}
 
-	for (size_t i = 0; i < dest.layers-1; i++) {
+	func(slices);
+	for (size_t w = 1; w < workers; w++) {
+		if (started[w]) {
+			pthread_join(threads[w], NULL);
+		}
+	}
+}
+#endif
 
-		// Scale and rotate gradient to steepest descent (see Section 7.2.1, p. 157)
-		matrix_transpose(&dest.deltas[i]);
-		matrix_multiply_scalar(dest.deltas[i], -dest.rate);
+typedef struct {
+	Matrix dest;
+	bool normal;
+	float a, b;	// Either bounds or mean and deviation
+	uint64_t seed, stream;
+	size_t from, to;	// Range of `dest.data` to fill, starting at a multiple of a block of lanes
+} MatrixRandom;
+
+VNNDEF void *matrix_random_range(void *range) {
+	MatrixRandom *src = range;
+
+	// Value at `data[i]` is the `i % 4` word of the `i / 4` counter, so it doesn't depend on the range,
+	// and normal values are made in pairs from the two halves of each counter (see Box-Muller transform)
+	uint32_t words[4][VNN_PHILOX_LANES];
+	for (size_t i = src->from; i < src->to; i += 4*VNN_PHILOX_LANES) {
+		vnn_philox(i/4, src->seed, src->stream, words);
+
+		for (size_t j = 0; j < 4*VNN_PHILOX_LANES && i+j < src->to; j += 2) {
+			float u = (words[j%4][j/4] >> 8) / 16777216.0f, v = (words[j%4 + 1][j/4] >> 8) / 16777216.0f;	// In $[0, 1)$ with 24 bits
+
+			float first, second;
+			if (src->normal) {
+				float radius = sqrtf(-2 * logf(1 - u)), angle = 6.2831853f * v;
+				first = src->a + src->b * radius * cosf(angle);
+				second = src->a + src->b * radius * sinf(angle);
+			} else {
+				first = src->a + (src->b - src->a) * u;
+				second = src->a + (src->b - src->a) * v;
+			}
 
-		// Update is performed *after* the backpropagation (see Section 7.3.2, p. 169)
-		Matrix updated_weights = matrix_add(dest.weights[i], dest.deltas[i]);
-		matrix_free(&dest.weights[i]);
-		dest.weights[i] = updated_weights;
+			src->dest.data[i+j] = VNN_DTYPE_FROM_FLOAT(first);
+			if (i+j+1 < src->to) {
+				src->dest.data[i+j+1] = VNN_DTYPE_FROM_FLOAT(second);
+			}
+		}
 	}
 
-	matrix_free(&to_units_derivative);
-	matrix_free(&to_error_derivative);
+	return NULL;
 }
 
-VNNDEF void network_free(Network *dest) {
-	assert(!NETWORK_FREED(*dest));
+VNNDEF void matrix_random(Matrix dest, bool normal, float a, float b, uint64_t seed, uint64_t stream) {
+	assert(!MATRIX_FREED(dest));
 
-	if (!MATRIX_FREED(dest->outputs[0])) {
-		matrix_free(&dest->outputs[0]);
+	size_t size = dest.rows*dest.cols, block = 4*VNN_PHILOX_LANES, blocks = (size + block-1) / block;
+	MatrixRandom range = {
+		.dest = dest, .normal = normal, .a = a, .b = b,
+		.seed = seed, .stream = stream,
+		.from = 0, .to = size
+	};
+
+#ifdef VNN_THREADS
+
+	// Blocks are split evenly between the workers, unless there are too few to be worth it
+	size_t workers = blocks >= 1024*VNN_WORKERS ? VNN_WORKERS : 1;
+	MatrixRandom ranges[VNN_WORKERS];
+	for (size_t w = 0; w < workers; w++) {
+		ranges[w] = range;
+		ranges[w].from = blocks*w / workers * block;
+		ranges[w].to = blocks*(w+1) / workers * block < size ? blocks*(w+1) / workers * block : size;
 	}
+	vnn_parallel(matrix_random_range, ranges, sizeof(ranges[0]), workers);
+#else
+	(void) blocks;
+	matrix_random_range(&range);
+#endif
+}
 
-	for (size_t i = 1; i < dest->layers; i++) {
-		matrix_free(&dest->weights[i-1]);
+VNNDEF void matrix_uniform(Matrix dest, float low, float high, uint64_t seed, uint64_t stream) {
+	assert(low <= high);
+	matrix_random(dest, false, low, high, seed, stream);
+}
 
-		if (!MATRIX_FREED(dest->diags[i-1])) {
-			matrix_free(&dest->diags[i-1]);
-		}
-		if (!MATRIX_FREED(dest->outputs[i])) {
-			matrix_free(&dest->outputs[i]);
+VNNDEF void matrix_normal(Matrix dest, float mean, float deviation, uint64_t seed, uint64_t stream) {
+	assert(deviation >= 0);
+	matrix_random(dest, true, mean, deviation, seed, stream);
+}
+
+VNNDEF SparseMatrix sparse_from(VNN_DTYPE *values, size_t *columns, size_t *offsets, size_t rows, size_t cols) {
+	assert(offsets != NULL && rows > 0 && cols > 0);
+	assert(offsets[rows] == offsets[0] || (values != NULL && columns != NULL));
+
+	return (SparseMatrix) {
+		.values = values, .columns = columns, .offsets = offsets,
+		.rows = rows, .cols = cols,
+		.freeable = false
+	};
+}
+
+VNNDEF SparseMatrix sparse_compress(Matrix src) {
+	assert(!MATRIX_FREED(src));
+
+	size_t nonzeros = 0;
+	for (size_t i = 0; i < src.rows*src.cols; i++) {
+		if (VNN_DTYPE_TO_FLOAT(src.data[i]) != 0) {
+			nonzeros++;
 		}
-		if (!MATRIX_FREED(dest->deltas[i-1])) {
-			matrix_free(&dest->deltas[i-1]);
+	}
+
+	SparseMatrix dest = {
+		.values = VNN_ALLOC((nonzeros > 0 ? nonzeros : 1) * sizeof(VNN_DTYPE)),
+		.columns = VNN_ALLOC((nonzeros > 0 ? nonzeros : 1) * sizeof(size_t)),
+		.offsets = VNN_ALLOC((src.rows+1) * sizeof(size_t)),
+		.rows = src.rows, .cols = src.cols,
+		.freeable = true
+	};
+
+	size_t k = 0;
+	for (size_t i = 0; i < src.rows; i++) {
+		dest.offsets[i] = k;
+		for (size_t j = 0; j < src.cols; j++) {
+			if (VNN_DTYPE_TO_FLOAT(MATRIX_AT(src, i, j)) != 0) {
+				dest.values[k] = MATRIX_AT(src, i, j);
+				dest.columns[k] = j;
+				k++;
+			}
 		}
 	}
+	dest.offsets[src.rows] = k;
 
-	VNN_FREE(dest->weights);
-	VNN_FREE(dest->diags);
-	VNN_FREE(dest->outputs);
-	VNN_FREE(dest->deltas);
-	memset(dest, 0, sizeof(Network));
+	return dest;
+}
+
+VNNDEF SparseMatrix sparse_clone(SparseMatrix src) {
+	assert(!SPARSE_FREED(src));
+
+	// Offsets are rebased, since `src` might be a slice of the rows of a bigger matrix
+	size_t nonzeros = SPARSE_NONZEROS(src);
+	SparseMatrix dest = {
+		.values = VNN_ALLOC((nonzeros > 0 ? nonzeros : 1) * sizeof(VNN_DTYPE)),
+		.columns = VNN_ALLOC((nonzeros > 0 ? nonzeros : 1) * sizeof(size_t)),
+		.offsets = VNN_ALLOC((src.rows+1) * sizeof(size_t)),
+		.rows = src.rows, .cols = src.cols,
+		.freeable = true
+	};
+
+	if (nonzeros > 0) {
+		memcpy(dest.values, &src.values[src.offsets[0]], nonzeros * sizeof(VNN_DTYPE));
+		memcpy(dest.columns, &src.columns[src.offsets[0]], nonzeros * sizeof(size_t));
+	}
+	for (size_t i = 0; i <= src.rows; i++) {
+		dest.offsets[i] = src.offsets[i] - src.offsets[0];
+	}
+
+	return dest;
 }
 
+VNNDEF Matrix sparse_multiply(SparseMatrix lhs, Matrix rhs) {
+	assert(!SPARSE_FREED(lhs) && !MATRIX_FREED(rhs));
+	assert(lhs.cols == rhs.rows);
+
+	// Only the rows of `rhs` matching the non-zero columns of `lhs` are ever read, and
+	// they are read sequentially by accumulating each row of the result at once
+	Matrix dest = matrix_empty(lhs.rows, rhs.cols);
+	float *sums = VNN_ALLOC(rhs.cols * sizeof(float));
+	for (size_t i = 0; i < lhs.rows; i++) {
+		memset(sums, 0, rhs.cols * sizeof(float));
+		for (size_t k = lhs.offsets[i]; k < lhs.offsets[i+1]; k++) {
+			assert(lhs.columns[k] < lhs.cols);
+
+			float value = VNN_DTYPE_TO_FLOAT(lhs.values[k]);
+			for (size_t j = 0; j < rhs.cols; j++) {
+				sums[j] += value * VNN_DTYPE_TO_FLOAT(MATRIX_AT(rhs, lhs.columns[k], j));
+			}
+		}
+
+		for (size_t j = 0; j < rhs.cols; j++) {
+			MATRIX_AT(dest, i, j) = VNN_DTYPE_FROM_FLOAT(sums[j]);
+		}
+	}
+
+	VNN_FREE(sums);
+	return dest;
+}
+
+VNNDEF Matrix matrix_multiply_sparse(Matrix lhs, SparseMatrix rhs) {
+	assert(!MATRIX_FREED(lhs) && !SPARSE_FREED(rhs));
+	assert(lhs.cols == rhs.rows);
+
+	// Each value of `lhs` scatters itself only over the non-zero values of its row in `rhs`,
+	// which makes zeros on either side free
+	Matrix dest = matrix_empty(lhs.rows, rhs.cols);
+	float *sums = VNN_ALLOC(rhs.cols * sizeof(float));
+	for (size_t i = 0; i < lhs.rows; i++) {
+		memset(sums, 0, rhs.cols * sizeof(float));
+		for (size_t k = 0; k < lhs.cols; k++) {
+			float value = VNN_DTYPE_TO_FLOAT(MATRIX_AT(lhs, i, k));
+			if (value == 0) {
+				continue;
+			}
+
+			for (size_t l = rhs.offsets[k]; l < rhs.offsets[k+1]; l++) {
+				sums[rhs.columns[l]] += value * VNN_DTYPE_TO_FLOAT(rhs.values[l]);
+			}
+		}
+
+		for (size_t j = 0; j < rhs.cols; j++) {
+			MATRIX_AT(dest, i, j) = VNN_DTYPE_FROM_FLOAT(sums[j]);
+		}
+	}
+
+	VNN_FREE(sums);
+	return dest;
+}
+
+VNNDEF void sparse_free(SparseMatrix *dest) {
+	assert(!SPARSE_FREED(*dest));
+	assert(dest->freeable);
+
+	VNN_FREE(dest->values);
+	VNN_FREE(dest->columns);
+	VNN_FREE(dest->offsets);
+	memset(dest, 0, sizeof(SparseMatrix));
+}
+
+VNNDEF Network network_new(
+	size_t *shape, size_t layers, float rate,
+	float (**activations)(float), float (**derivatives)(float),
+	float (*rand)(void)
+) {
+	assert(shape != NULL && shape[0] > 0 && layers >= 2);
+	assert(activations != NULL && derivatives != NULL);
+
+	size_t betweens = (layers-1) * sizeof(Matrix);
+	Network dest = {
+		.layers = layers, .rate = rate,
+		.s = activations, .ds = derivatives,
+		.loss = NETWORK_LOSS_MSE,
+		.weights = VNN_ALLOC(betweens),
+
+		.deltas = VNN_CALLOC(betweens),
+		.derivatives = VNN_CALLOC(betweens),	// At `derivatives[0]` are the derivatives of the 2nd layer
+		.outputs = VNN_CALLOC(1*sizeof(Matrix) + betweens),	// At `outputs[0]` is the extended input batch
+		.sparse = VNN_CALLOC(sizeof(SparseMatrix)),
+		.pruned = VNN_CALLOC((layers-1) * sizeof(SparseMatrix)),
+#ifdef VNN_PROFILE
+		.profile = VNN_CALLOC((layers-1) * NETWORK_PHASES * sizeof(NetworkProfile))
+#endif
+	};
+
+	for (size_t i = 0; i < layers-1; i++) {
+		assert(activations[i] != NULL && derivatives[i] != NULL);
+
+		// Matrices are shaped $(n+1) \times k$ where $n$ is the number of the previous layer units,
+		// extended to include the biases and $k$ is the number of the next layer units.
+		// Each weight $w_{ij}$ at the $i$-th row and $j$-th column is the connection between the $i$-th
+		// unit of the previous layer and the $j$-th unit of the next one (see Section 7.3.1, p. 165)
+		dest.weights[i] = rand != NULL ? matrix_rand(shape[i]+1, shape[i+1], rand) : matrix_empty(shape[i]+1, shape[i+1]);
+	}
+
+	return dest;
+}
+
+VNNDEF void network_init(Network dest, NetworkInit init, uint64_t seed) {
+	assert(!NETWORK_FREED(dest));
+
+	// Each weights matrix is its own stream, so a layer is the same whatever the others look like
+	for (size_t i = 0; i < dest.layers-1; i++) {
+		Matrix without_bias = dest.weights[i];
+		without_bias.rows--;
+		size_t inputs = without_bias.rows, outputs = without_bias.cols;
+
+		// Scale keeps the variance of the excitations the same across layers (see Glorot and Bengio, 2010
+		// for Xavier, and He et al., 2015)
+		switch (init) {
+			case NETWORK_INIT_XAVIER: {
+				float limit = sqrtf(6.0f / (inputs + outputs));
+				matrix_uniform(without_bias, -limit, limit, seed, i);
+				break;
+			}
+
+			case NETWORK_INIT_HE:
+				matrix_normal(without_bias, 0, sqrtf(2.0f / inputs), seed, i);
+				break;
+
+			default:
+				assert(false && "Unknown initialization");
+		}
+
+		// Biases start from zero, since the weights already break the symmetry between the units
+		for (size_t k = 0; k < outputs; k++) {
+			MATRIX_AT(dest.weights[i], inputs, k) = VNN_DTYPE_FROM_FLOAT(0);
+		}
+
+		if (!SPARSE_FREED(dest.pruned[i])) {
+			sparse_free(&dest.pruned[i]);
+		}
+	}
+}
+
+VNNDEF Network network_share(Network src) {	// Network with the same weights as `src`, but fed on its own
+	assert(!NETWORK_FREED(src));
+
+	size_t betweens = (src.layers-1) * sizeof(Matrix);
+	Network dest = src;
+	dest.weights = VNN_ALLOC(betweens);
+	for (size_t i = 0; i < src.layers-1; i++) {
+		dest.weights[i] = src.weights[i];
+		dest.weights[i].freeable = false;	// Left to `src` by `network_free`
+	}
+
+	dest.deltas = VNN_CALLOC(betweens);
+	dest.derivatives = VNN_CALLOC(betweens);
+	dest.outputs = VNN_CALLOC(1*sizeof(Matrix) + betweens);
+	dest.sparse = VNN_CALLOC(sizeof(SparseMatrix));
+	dest.pruned = VNN_CALLOC((src.layers-1) * sizeof(SparseMatrix));	// Zeros are still in the weights anyway
+#ifdef VNN_PROFILE
+	dest.profile = VNN_CALLOC((src.layers-1) * NETWORK_PHASES * sizeof(NetworkProfile));
+#endif
+	return dest;
+}
+
+VNNDEF Matrix network_excite(Network src, size_t layer) {	// Excitations of `layer` from the outputs of the previous one
+	if (layer == 1 && !SPARSE_FREED(*src.sparse)) {
+
+		// Excitations gather only the weights of the non-zero inputs, with the biases added on top
+		Matrix without_bias = src.weights[0];
+		without_bias.rows--;
+		Matrix excitations = sparse_multiply(*src.sparse, without_bias);
+		for (size_t i = 0; i < excitations.rows; i++) {
+			for (size_t j = 0; j < excitations.cols; j++) {
+				MATRIX_AT(excitations, i, j) = VNN_DTYPE_FROM_FLOAT(
+					VNN_DTYPE_TO_FLOAT(MATRIX_AT(excitations, i, j)) +
+					VNN_DTYPE_TO_FLOAT(MATRIX_AT(src.weights[0], without_bias.rows, j))
+				);
+			}
+		}
+		return excitations;
+	}
+
+	if (!SPARSE_FREED(src.pruned[layer-1])) {
+		return matrix_multiply_sparse(src.outputs[layer-1], src.pruned[layer-1]);
+	}
+	return matrix_multiply(src.outputs[layer-1], src.weights[layer-1]);
+}
+
+#ifdef VNN_PROFILE
+VNNDEF double network_excite_flops(Network src, size_t layer, size_t batch) {	// Upper bound of `network_excite`
+	size_t units = src.weights[layer-1].cols;
+	if (layer == 1 && !SPARSE_FREED(*src.sparse)) {
+		return 2.0 * SPARSE_NONZEROS(*src.sparse) * units + batch * units;
+	} else if (!SPARSE_FREED(src.pruned[layer-1])) {
+		return 2.0 * batch * SPARSE_NONZEROS(src.pruned[layer-1]);
+	}
+	return 2.0 * batch * src.weights[layer-1].rows * units;
+}
+#endif
+
+VNNDEF Matrix network_propagate(Network dest, bool derivatives) {	// Given the inputs in either `outputs[0]` or `sparse`
+	for (size_t i = 1; i < dest.layers; i++) {
+		if (!MATRIX_FREED(dest.outputs[i])) {
+			matrix_free(&dest.outputs[i]);
+		}
+		if (!MATRIX_FREED(dest.derivatives[i-1])) {
+			matrix_free(&dest.derivatives[i-1]);
+		}
+
+		// Computes the excitation, i.e. weighted sum, of the inputs
+		// (see Section 6.1.1, p. 125 and Section 7.3.1, p. 165)
+		VNN_PROFILE_BEGIN(dest, i-1, NETWORK_PHASE_FORWARD);
+		Matrix excitations = network_excite(dest, i);
+
+		// Unit is considered active when its activation, given by the function $s(x)$ where $x$ is the
+		// excitation, is greater than a given threshold, i.e. the bias (see Figure 3.5, p. 61).
+		// The softmax is fused with the cross-entropy instead, so that its derivative is never needed
+		bool softmax = i == dest.layers-1 && dest.loss == NETWORK_LOSS_CROSS_ENTROPY;
+		Matrix activated = matrix_empty(excitations.cols+1, excitations.rows);
+		matrix_transpose(&activated);	// Stored by columns, so that dropping the biases column is still a valid matrix
+		for (size_t j = 0; j < excitations.rows; j++) {
+			float max = -INFINITY, sum = 0;
+			for (size_t k = 0; softmax && k < excitations.cols; k++) {
+				float excitation = VNN_DTYPE_TO_FLOAT(MATRIX_AT(excitations, j, k));
+				if (excitation > max) {
+					max = excitation;
+				}
+			}
+
+			for (size_t k = 0; k < excitations.cols; k++) {
+				float excitation = VNN_DTYPE_TO_FLOAT(MATRIX_AT(excitations, j, k));
+				float activation = softmax ? expf(excitation - max) : dest.s[i-1](excitation);	// Shifted for stability
+				sum += activation;
+
+				MATRIX_AT(activated, j, k) = VNN_DTYPE_FROM_FLOAT(activation);
+			}
+			for (size_t k = 0; softmax && k < excitations.cols; k++) {
+				MATRIX_AT(activated, j, k) = VNN_DTYPE_FROM_FLOAT(VNN_DTYPE_TO_FLOAT(MATRIX_AT(activated, j, k)) / sum);
+			}
+
+			MATRIX_AT(activated, j, excitations.cols) = VNN_DTYPE_FROM_FLOAT(1);	// NOTE: Technically the bias input doesn't have to be 1; TODO: Actually try to remove this line
+		}
+		VNN_PROFILE_END(
+			dest, i-1, NETWORK_PHASE_FORWARD,
+			network_excite_flops(dest, i, excitations.rows) + (softmax ? 3.0 : 1.0) * excitations.rows * excitations.cols
+		);
+
+		dest.outputs[i] = activated;
+		if (!derivatives) {
+			matrix_free(&excitations);
+			continue;
+		}
+
+		// Derivatives are stored during the feed forward step so that we don't have to recompute
+		// the excitations (see Section 7.2.2, p. 157), which are overwritten as they're not needed anymore
+		VNN_PROFILE_BEGIN(dest, i-1, NETWORK_PHASE_DERIVATIVE);
+		for (size_t j = 0; j < excitations.rows; j++) {
+			for (size_t k = 0; k < excitations.cols; k++) {
+				float excitation = VNN_DTYPE_TO_FLOAT(MATRIX_AT(excitations, j, k));
+				MATRIX_AT(excitations, j, k) = VNN_DTYPE_FROM_FLOAT(dest.ds[i-1](excitation));
+			}
+		}
+		VNN_PROFILE_END(dest, i-1, NETWORK_PHASE_DERIVATIVE, excitations.rows * excitations.cols);
+
+		dest.derivatives[i-1] = excitations;
+	}
+
+	Matrix output = dest.outputs[dest.layers-1];
+	output.cols--;
+	output.freeable = false;
+	return output;
+}
+
+VNNDEF void network_load(Network dest, Matrix input) {	// Sets up `input` for `network_propagate`
+	assert(!NETWORK_FREED(dest));
+	assert(input.rows > 0 && input.cols == dest.weights[0].rows-1);
+
+	if (!SPARSE_FREED(*dest.sparse)) {
+		sparse_free(dest.sparse);
+	}
+
+	// Each row of `input` is a sample of the batch, which is carried along as the rows of every output
+	if (!MATRIX_FREED(dest.outputs[0])) {
+		matrix_free(&dest.outputs[0]);
+	}
+	dest.outputs[0] = matrix_empty(input.rows, input.cols+1);
+	for (size_t i = 0; i < input.rows; i++) {
+		for (size_t j = 0; j < input.cols; j++) {
+			MATRIX_AT(dest.outputs[0], i, j) = MATRIX_AT(input, i, j);
+		}
+		MATRIX_AT(dest.outputs[0], i, input.cols) = VNN_DTYPE_FROM_FLOAT(1);	// Extend input with bias
+	}
+}
+
+VNNDEF Matrix network_feed(Network dest, Matrix input) {
+	network_load(dest, input);
+	return network_propagate(dest, true);
+}
+
+VNNDEF Matrix network_predict(Network dest, Matrix input) {
+
+	// Derivatives are only needed by `network_adjust`, so inference can skip them altogether
+	network_load(dest, input);
+	return network_propagate(dest, false);
+}
+
+VNNDEF Matrix network_feed_sparse(Network dest, SparseMatrix input) {
+	assert(!NETWORK_FREED(dest) && !SPARSE_FREED(input));
+	assert(input.rows > 0 && input.cols == dest.weights[0].rows-1);
+
+	if (!MATRIX_FREED(dest.outputs[0])) {
+		matrix_free(&dest.outputs[0]);
+	}
+
+	// Input is kept sparse, since `network_adjust` only needs its non-zero values
+	if (!SPARSE_FREED(*dest.sparse)) {
+		sparse_free(dest.sparse);
+	}
+	*dest.sparse = sparse_clone(input);
+
+	return network_propagate(dest, true);
+}
+
+VNNDEF float network_loss(Network src, Matrix target, Matrix gradient) {
+	assert(!NETWORK_FREED(src) && !MATRIX_FREED(src.outputs[src.layers-1]));
+	assert(MATRIX_FREED(gradient) || !MATRIX_FREED(src.derivatives[0]));
+
+	Matrix output = src.outputs[src.layers-1];
+	output.cols--;
+	assert(target.rows == output.rows && target.cols == output.cols);
+	assert(MATRIX_FREED(gradient) || (gradient.rows == output.rows && gradient.cols == output.cols));
+
+	// Error is averaged over the samples of the batch, which reduces to the on-line
+	// evaluation (see Section 7.3.2, p. 170) when the batch has only one sample.
+	// When `gradient` is given, it's filled with the derivative of the error up to the
+	// network outputs, i.e. w.r.t. the excitations of the last layer (see Section 7.3.3, p. 171)
+	float error = 0;
+	Matrix derivatives = src.derivatives[src.layers-2];
+	for (size_t i = 0; i < output.rows; i++) {
+		for (size_t j = 0; j < output.cols; j++) {
+			float o = VNN_DTYPE_TO_FLOAT(MATRIX_AT(output, i, j));
+			float t = VNN_DTYPE_TO_FLOAT(MATRIX_AT(target, i, j));
+
+			float derivative;
+			switch (src.loss) {
+				case NETWORK_LOSS_MSE:
+
+					// Mean Squared Error as $\frac{1}{2}\|o_i - t_i\|^2$ (see Section 7.2.1, p. 156)
+					error += (o - t)*(o - t) / 2.0;	// Derivative cancels 2 out
+					derivative = MATRIX_FREED(gradient) ? 0 : (o - t) * VNN_DTYPE_TO_FLOAT(MATRIX_AT(derivatives, i, j));
+					break;
+
+				case NETWORK_LOSS_CROSS_ENTROPY:
+
+					// Cross-entropy as $-\sum_j t_{ij} \log o_{ij}$ where $o_i$ is the softmax of the
+					// excitations, whose derivative w.r.t. the excitations simplifies to $o_i - t_i$
+					error -= t * logf(o > 1e-7 ? o : 1e-7);	// Clamped since `o` might round to 0
+					derivative = o - t;
+					break;
+
+				default:
+					assert(false && "Unknown loss");
+					derivative = 0;
+			}
+
+			if (!MATRIX_FREED(gradient)) {
+				MATRIX_AT(gradient, i, j) = VNN_DTYPE_FROM_FLOAT(derivative);
+			}
+		}
+	}
+
+	return error / output.rows;
+}
+
+VNNDEF float network_error(Network src, Matrix target) {
+	return network_loss(src, target, (Matrix) {0});
+}
+
+VNNDEF float network_adjust(Network dest, Matrix target) {
+	assert(!NETWORK_FREED(dest) && !MATRIX_FREED(dest.derivatives[0]));
+	assert(target.cols == dest.weights[dest.layers-2].cols);
+
+	// NOTE:
+	// Grasping the results of the operations might be easier by commenting on each line the inputs
+	// and output shape, e.g. `delta` on the first iteration would be "4x1 . 1x2 = 4x2" for a network
+	// of shape `{2, 3, 2}` and a batch of 1 sample, since `to_units_derivative` is "1x2", i.e. one
+	// row per sample, and "4x1" are the extended outputs of the hidden layer transposed
+
+	Matrix output = dest.outputs[dest.layers-1];
+	size_t batch = output.rows;
+
+	// Derivative up to the network outputs, with the error computed along the way
+	VNN_PROFILE_BEGIN(dest, dest.layers-2, NETWORK_PHASE_BACKWARD);
+	Matrix to_units_derivative = matrix_empty(batch, output.cols-1);
+	float error = network_loss(dest, target, to_units_derivative);
+
+	for (size_t i = dest.layers-1; i > 0; i--) {
+		VNN_PROFILE_BEGIN(dest, i-1, NETWORK_PHASE_BACKWARD);	// Already begun for the last layer
+
+		// Direction of steepest descent (from weights gradient; see Section 7.1.1, p. 151)
+		// on the error function, w.r.t. the weights between the previous and next layer,
+		// is given by the inputs times the derivative until the next layer, because the
+		// derivation need not propagate further as current weights don't influence previous
+		// layers. E.g. $\frac{\partial}{\partial w}s(i \cdot w) = s'(i \cdot w) \cdot i$
+		// shows how the last step of the chain rule is to multiply by the constant $i$.
+		// With more samples, the product also sums the gradients of the whole batch
+		if (i > 1 || SPARSE_FREED(*dest.sparse)) {	// Sparse inputs are handled by the update instead
+			Matrix inputs = dest.outputs[i-1];
+			matrix_transpose(&inputs);
+
+			// Deltas have the shape of the weights, so they are allocated once and overwritten on every step
+			if (MATRIX_FREED(dest.deltas[i-1])) {
+				dest.deltas[i-1] = matrix_empty(dest.weights[i-1].rows, dest.weights[i-1].cols);
+			}
+
+			// Scale gradient to steepest descent (see Section 7.2.1, p. 157), averaged over the batch,
+			// as it's written rather than in another pass over the deltas
+			matrix_multiply_into(dest.deltas[i-1], inputs, to_units_derivative, -dest.rate / batch);
+		} else if (!MATRIX_FREED(dest.deltas[i-1])) {
+			matrix_free(&dest.deltas[i-1]);
+		}
+
+		if (i > 1) {	// No need to propagate to the inputs, since they don't have any derivative
+
+			// Derivatives w.r.t. any of the previous layers weights don't depend on the next layer
+			// biases, since they have no effect on the gradient of the previous layer weights and
+			// they have no connection to the previous layers (see Section 7.3.3, p. 170)
+			Matrix without_bias = dest.weights[i-1];
+			without_bias.rows--;
+			matrix_transpose(&without_bias);	// Rows of the weights become contiguous columns, so no copy is needed
+
+			// Propagate the derivative to the previous layer units (see Section 7.3.3, p. 171),
+			// where the product with the stored derivatives is the same as multiplying by their
+			// diagonalization, just without going through the zeros
+			Matrix to_weights_derivative = matrix_multiply(to_units_derivative, without_bias);
+			matrix_free(&to_units_derivative);
+			matrix_evaluate(
+				to_weights_derivative,
+				MATRIX_LAZY_HADAMARD(MATRIX_LAZY(to_weights_derivative), MATRIX_LAZY(dest.derivatives[i-2]))
+			);
+			to_units_derivative = to_weights_derivative;
+		}
+
+		VNN_PROFILE_END(
+			dest, i-1, NETWORK_PHASE_BACKWARD,
+			(i == dest.layers-1 ? 3.0 * batch * dest.weights[i-1].cols : 0) +
+			(!MATRIX_FREED(dest.deltas[i-1]) ? (2.0 * batch + 1) * dest.weights[i-1].rows * dest.weights[i-1].cols : 0) +
+			(i > 1 ? (2.0 * dest.weights[i-1].cols + 1) * batch * (dest.weights[i-1].rows-1) : 0)
+		);
+	}
+
+	// Update is performed *after* the backpropagation (see Section 7.3.2, p. 169),
+	// which also revives any pruned weight as it's no longer necessarily zero
+	for (size_t i = 0; i < dest.layers-1; i++) {
+		if (!SPARSE_FREED(dest.pruned[i])) {
+			sparse_free(&dest.pruned[i]);
+		}
+		if (MATRIX_FREED(dest.deltas[i])) {
+			continue;
+		}
+
+		VNN_PROFILE_BEGIN(dest, i, NETWORK_PHASE_UPDATE);
+		matrix_evaluate(dest.weights[i], MATRIX_LAZY_ADD(MATRIX_LAZY(dest.weights[i]), MATRIX_LAZY(dest.deltas[i])));
+		VNN_PROFILE_END(dest, i, NETWORK_PHASE_UPDATE, dest.weights[i].rows * dest.weights[i].cols);
+	}
+
+	// Inputs that are zero have zero gradient, so for sparse inputs only the rows of the weights
+	// from their non-zero values, plus the biases, are updated without any dense `deltas[0]`
+	if (!SPARSE_FREED(*dest.sparse)) {
+		SparseMatrix input = *dest.sparse;
+		Matrix weights = dest.weights[0];
+		float scale = -dest.rate / batch;
+
+		VNN_PROFILE_BEGIN(dest, 0, NETWORK_PHASE_UPDATE);
+		for (size_t i = 0; i < batch; i++) {
+			for (size_t k = input.offsets[i]; k <= input.offsets[i+1]; k++) {
+				bool bias = k == input.offsets[i+1];	// Last iteration is for the bias input
+				size_t row = bias ? input.cols : input.columns[k];
+				float value = bias ? 1 : VNN_DTYPE_TO_FLOAT(input.values[k]);
+
+				for (size_t j = 0; j < weights.cols; j++) {
+					MATRIX_AT(weights, row, j) = VNN_DTYPE_FROM_FLOAT(
+						VNN_DTYPE_TO_FLOAT(MATRIX_AT(weights, row, j)) +
+						scale * value * VNN_DTYPE_TO_FLOAT(MATRIX_AT(to_units_derivative, i, j))
+					);
+				}
+			}
+		}
+		VNN_PROFILE_END(dest, 0, NETWORK_PHASE_UPDATE, 3.0 * (SPARSE_NONZEROS(input) + batch) * weights.cols);
+	}
+
+	matrix_free(&to_units_derivative);
+	return error;
+}
+
+VNNDEF float network_threshold(Network src, float ratio) {
+	assert(!NETWORK_FREED(src));
+	assert(ratio >= 0 && ratio <= 1);
+
+	// Magnitude below which the given ratio of weights falls, which is found by bisection
+	// on the magnitudes rather than by sorting them, so that no copy of the weights is needed.
+	// Biases, i.e. the last row of each matrix, are never pruned so they're not counted
+	size_t total = 0;
+	float low = 0, high = 0;
+	for (size_t i = 0; i < src.layers-1; i++) {
+		Matrix weights = src.weights[i];
+		for (size_t j = 0; j < weights.rows-1; j++) {
+			for (size_t k = 0; k < weights.cols; k++) {
+				float magnitude = fabsf(VNN_DTYPE_TO_FLOAT(MATRIX_AT(weights, j, k)));
+				if (magnitude > high) {
+					high = magnitude;
+				}
+			}
+		}
+		total += (weights.rows-1) * weights.cols;
+	}
+
+	for (size_t step = 0; step < 32; step++) {
+		float middle = (low + high) / 2;
+
+		size_t below = 0;
+		for (size_t i = 0; i < src.layers-1; i++) {
+			Matrix weights = src.weights[i];
+			for (size_t j = 0; j < weights.rows-1; j++) {
+				for (size_t k = 0; k < weights.cols; k++) {
+					below += fabsf(VNN_DTYPE_TO_FLOAT(MATRIX_AT(weights, j, k))) <= middle;
+				}
+			}
+		}
+
+		if (below >= ratio * total) {
+			high = middle;
+		} else {
+			low = middle;
+		}
+	}
+
+	return high;
+}
+
+VNNDEF float network_prune(Network dest, float threshold) {
+	assert(!NETWORK_FREED(dest));
+
+	// Weights whose magnitude doesn't exceed `threshold` are zeroed, and the weights are then
+	// compressed so that the feed forward step skips them until the next `network_adjust`
+	size_t pruned = 0, total = 0;
+	for (size_t i = 0; i < dest.layers-1; i++) {
+		Matrix weights = dest.weights[i];
+		for (size_t j = 0; j < weights.rows-1; j++) {	// Biases are left alone
+			for (size_t k = 0; k < weights.cols; k++) {
+				if (fabsf(VNN_DTYPE_TO_FLOAT(MATRIX_AT(weights, j, k))) <= threshold) {
+					MATRIX_AT(weights, j, k) = VNN_DTYPE_FROM_FLOAT(0);
+				}
+				pruned += VNN_DTYPE_TO_FLOAT(MATRIX_AT(weights, j, k)) == 0;
+			}
+		}
+		total += (weights.rows-1) * weights.cols;
+
+		if (!SPARSE_FREED(dest.pruned[i])) {
+			sparse_free(&dest.pruned[i]);
+		}
+		dest.pruned[i] = sparse_compress(weights);
+	}
+
+	return (float) pruned / total;	// Sparsity achieved
+}
+
+typedef struct {
+	Network network;
+	Matrix inputs, targets;
+	size_t batch, from, to;	// Range of samples, i.e. rows, to evaluate
+
+	double loss;
+	size_t correct;
+} NetworkSlice;
+
+VNNDEF void *network_evaluate_slice(void *slice) {
+	NetworkSlice *src = slice;
+	size_t units = src->targets.cols;
+
+	for (size_t i = src->from; i < src->to; i += src->batch) {
+		size_t rows = src->to - i < src->batch ? src->to - i : src->batch;
+		Matrix input = matrix_from(&src->inputs.data[i*src->inputs.cols], rows, src->inputs.cols);
+		Matrix target = matrix_from(&src->targets.data[i*units], rows, units);
+
+		Matrix output = network_predict(src->network, input);
+		src->loss += (double) network_error(src->network, target) * rows;
+
+		// Sample is correct when its largest output is where its largest target is,
+		// or when it's on the same side of 0.5 as the target for single outputs
+		for (size_t j = 0; j < rows; j++) {
+			size_t guess = 0, truth = 0;
+			for (size_t k = 1; k < units; k++) {
+				if (VNN_DTYPE_TO_FLOAT(MATRIX_AT(output, j, k)) > VNN_DTYPE_TO_FLOAT(MATRIX_AT(output, j, guess))) {
+					guess = k;
+				}
+				if (VNN_DTYPE_TO_FLOAT(MATRIX_AT(target, j, k)) > VNN_DTYPE_TO_FLOAT(MATRIX_AT(target, j, truth))) {
+					truth = k;
+				}
+			}
+
+			if (units == 1) {
+				src->correct += (VNN_DTYPE_TO_FLOAT(MATRIX_AT(output, j, 0)) > 0.5) == (VNN_DTYPE_TO_FLOAT(MATRIX_AT(target, j, 0)) > 0.5);
+			} else {
+				src->correct += guess == truth;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+VNNDEF NetworkEvaluation network_evaluate(Network src, Matrix inputs, Matrix targets, size_t batch) {
+	assert(!NETWORK_FREED(src) && !MATRIX_FREED(inputs) && !MATRIX_FREED(targets));
+	assert(inputs.rows > 0 && inputs.rows == targets.rows && !inputs.transposed && !targets.transposed);
+	assert(inputs.cols == src.weights[0].rows-1 && targets.cols == src.weights[src.layers-2].cols);
+	assert(batch > 0);
+
+	// Samples are fed by networks sharing the weights of `src`, which itself is left untouched, so that
+	// evaluating in between `network_feed` and `network_adjust` doesn't change the adjustment
+	size_t batches = (inputs.rows + batch-1) / batch;
+	NetworkSlice slice = {
+		.inputs = inputs, .targets = targets,
+		.batch = batch, .from = 0, .to = inputs.rows
+	};
+
+#ifdef VNN_THREADS
+
+	// Batches are split evenly between the workers, if there are enough of them
+	size_t workers = batches >= VNN_WORKERS ? VNN_WORKERS : 1;
+	NetworkSlice slices[VNN_WORKERS];
+	for (size_t w = 0; w < workers; w++) {
+		slices[w] = slice;
+		slices[w].network = network_share(src);
+		slices[w].from = batches*w / workers * batch;
+		slices[w].to = batches*(w+1) / workers * batch < inputs.rows ? batches*(w+1) / workers * batch : inputs.rows;
+	}
+	vnn_parallel(network_evaluate_slice, slices, sizeof(slices[0]), workers);
+#else
+	size_t workers = 1;
+	NetworkSlice slices[1] = {slice};
+	slices[0].network = network_share(src);
+	network_evaluate_slice(&slices[0]);
+	(void) batches;
+#endif
+
+	double loss = 0;
+	size_t correct = 0;
+	for (size_t w = 0; w < workers; w++) {
+		loss += slices[w].loss;
+		correct += slices[w].correct;
+		network_free(&slices[w].network);
+	}
+
+	return (NetworkEvaluation) {
+		.loss = loss / inputs.rows,
+		.accuracy = (float) correct / inputs.rows
+	};
+}
+
+VNNDEF void network_free(Network *dest) {
+	assert(!NETWORK_FREED(*dest));
+
+	if (!MATRIX_FREED(dest->outputs[0])) {
+		matrix_free(&dest->outputs[0]);
+	}
+	if (!SPARSE_FREED(*dest->sparse)) {
+		sparse_free(dest->sparse);
+	}
+
+	for (size_t i = 1; i < dest->layers; i++) {
+		if (dest->weights[i-1].freeable) {	// Otherwise shared by `network_share`
+			matrix_free(&dest->weights[i-1]);
+		}
+
+		if (!SPARSE_FREED(dest->pruned[i-1])) {
+			sparse_free(&dest->pruned[i-1]);
+		}
+		if (!MATRIX_FREED(dest->derivatives[i-1])) {
+			matrix_free(&dest->derivatives[i-1]);
+		}
+		if (!MATRIX_FREED(dest->outputs[i])) {
+			matrix_free(&dest->outputs[i]);
+		}
+		if (!MATRIX_FREED(dest->deltas[i-1])) {
+			matrix_free(&dest->deltas[i-1]);
+		}
+	}
+
+	VNN_FREE(dest->weights);
+	VNN_FREE(dest->derivatives);
+	VNN_FREE(dest->outputs);
+	VNN_FREE(dest->deltas);
+	VNN_FREE(dest->sparse);
+	VNN_FREE(dest->pruned);
+#ifdef VNN_PROFILE
+	VNN_FREE(dest->profile);
+#endif
+	memset(dest, 0, sizeof(Network));
+}
+
+#ifdef VNN_PROFILE
+VNNDEF NetworkProfile network_profile(Network src, size_t layer, NetworkPhase phase) {
+	assert(!NETWORK_FREED(src));
+	assert(layer < src.layers-1 && phase < NETWORK_PHASES);
+
+	return src.profile[layer*NETWORK_PHASES + phase];
+}
+
+VNNDEF void network_profile_begin(Network dest, size_t layer, NetworkPhase phase) {
+	assert(layer < dest.layers-1 && phase < NETWORK_PHASES);
+
+	// Beginning a phase already in progress does nothing, so that a phase may start earlier
+	NetworkProfile *profile = &dest.profile[layer*NETWORK_PHASES + phase];
+	if (profile->running) {
+		return;
+	}
+
+	profile->running = true;
+	profile->started_bytes = vnn_allocated;
+	profile->started_allocations = vnn_allocations;
+	profile->started = VNN_PROFILE_CLOCK();
+}
+
+VNNDEF void network_profile_end(Network dest, size_t layer, NetworkPhase phase, double flops) {
+	assert(layer < dest.layers-1 && phase < NETWORK_PHASES);
+
+	double ended = VNN_PROFILE_CLOCK();
+	NetworkProfile *profile = &dest.profile[layer*NETWORK_PHASES + phase];
+	assert(profile->running);
+
+	profile->running = false;
+	profile->calls++;
+	profile->seconds += ended - profile->started;
+	profile->flops += flops;
+	profile->bytes += vnn_allocated - profile->started_bytes;
+	profile->allocations += vnn_allocations - profile->started_allocations;
+}
+
+VNNDEF void network_profile_reset(Network dest) {
+	assert(!NETWORK_FREED(dest));
+	memset(dest.profile, 0, (dest.layers-1) * NETWORK_PHASES * sizeof(NetworkProfile));
+}
+
+VNNDEF void network_profile_dump(Network src, FILE *stream) {
+	assert(!NETWORK_FREED(src) && stream != NULL);
+
+	const char *phases[NETWORK_PHASES] = {"forward", "derivative", "backward", "update"};
+	double total = 0;
+	for (size_t i = 0; i < (src.layers-1) * NETWORK_PHASES; i++) {
+		total += src.profile[i].seconds;
+	}
+
+	fprintf(stream, "%-6s %-10s %10s %12s %6s %10s %12s %8s\n", "layer", "phase", "calls", "seconds", "%", "GFLOP/s", "bytes", "allocs");
+	for (size_t i = 0; i < src.layers-1; i++) {
+		for (size_t p = 0; p < NETWORK_PHASES; p++) {
+			NetworkProfile profile = src.profile[i*NETWORK_PHASES + p];
+			if (profile.calls == 0) {
+				continue;
+			}
+
+			fprintf(
+				stream, "%-6lu %-10s %10lu %12.6f %6.2f %10.3f %12lu %8lu\n",
+				(unsigned long) i, phases[p], (unsigned long) profile.calls, profile.seconds,
+				total > 0 ? profile.seconds / total * 100 : 0,
+				profile.seconds > 0 ? profile.flops / profile.seconds / 1e9 : 0,
+				(unsigned long) profile.bytes, (unsigned long) profile.allocations
+			);
+		}
+	}
+}
+#endif
+
+#ifdef VNN_THREADS
+VNNDEF double network_queue_clock(void) {	// Same clock as `pthread_cond_timedwait`
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+VNNDEF void *network_queue_run(void *queue) {
+	NetworkQueue *src = queue;
+	size_t units = src->network.weights[0].rows-1;
+
+	pthread_mutex_lock(&src->lock);
+	while (true) {
+		while (src->head == NULL && !src->stopping) {
+			pthread_cond_wait(&src->pending, &src->lock);
+		}
+		if (src->head == NULL) {
+			break;	// Stopping, with nothing left to serve
+		}
+
+		// Oldest request waits for others to fill the batch up until its deadline at most
+		double deadline = src->head->submitted + src->deadline;
+		struct timespec until = {
+			.tv_sec = (time_t) deadline,
+			.tv_nsec = (long) ((deadline - (time_t) deadline) * 1e9)
+		};
+		while (src->length < src->batch && !src->stopping && network_queue_clock() < deadline) {
+			pthread_cond_timedwait(&src->pending, &src->lock, &until);
+		}
+
+		NetworkRequest *batch = src->head, *last = batch;
+		size_t size = 1;
+		while (size < src->batch && last->next != NULL) {
+			last = last->next;
+			size++;
+		}
+		src->head = last->next;
+		if (src->head == NULL) {
+			src->tail = NULL;
+		}
+		src->length -= size;
+		last->next = NULL;
+
+		double dispatched = network_queue_clock();
+		pthread_mutex_unlock(&src->lock);
+
+		// Requests are stacked as the rows of a single input, so that they're fed all at once
+		Matrix input = matrix_empty(size, units);
+		size_t i = 0;
+		for (NetworkRequest *request = batch; request != NULL; request = request->next, i++) {
+			for (size_t j = 0; j < units; j++) {
+				MATRIX_AT(input, i, j) = MATRIX_AT(request->input, 0, j);
+			}
+		}
+
+		Matrix output = network_predict(src->network, input);
+		matrix_free(&input);
+
+		i = 0;
+		for (NetworkRequest *request = batch; request != NULL; request = request->next, i++) {
+			request->output = matrix_empty(1, output.cols);
+			for (size_t j = 0; j < output.cols; j++) {
+				MATRIX_AT(request->output, 0, j) = MATRIX_AT(output, i, j);
+			}
+		}
+
+		double completed = network_queue_clock();
+		pthread_mutex_lock(&src->lock);
+
+		// Requests might be gone as soon as they're given back, so everything needed from them is read
+		// before, and the ones with a callback are linked among themselves to be given back afterwards
+		NetworkRequest *callbacks = NULL, **last_callback = &callbacks;
+		src->batches++;
+		src->histogram[size-1]++;
+		for (NetworkRequest *request = batch; request != NULL;) {
+			NetworkRequest *next = request->next;
+
+			double waited = dispatched - request->submitted;
+			src->requests++;
+			src->waited += waited;
+			src->served += completed - request->submitted;
+			if (waited > src->waited_max) {
+				src->waited_max = waited;
+			}
+
+			if (request->callback != NULL) {
+				*last_callback = request;
+				last_callback = &request->next;
+			} else {
+				request->done = true;
+			}
+			request = next;
+		}
+		*last_callback = NULL;
+		pthread_cond_broadcast(&src->completed);
+		pthread_mutex_unlock(&src->lock);
+
+		for (NetworkRequest *request = callbacks; request != NULL;) {
+			NetworkRequest *next = request->next;
+			request->callback(request);
+			request = next;
+		}
+
+		pthread_mutex_lock(&src->lock);
+	}
+	pthread_mutex_unlock(&src->lock);
+
+	return NULL;
+}
+
+VNNDEF NetworkQueue *network_queue_new(Network src, size_t batch, double deadline) {
+	assert(!NETWORK_FREED(src));
+	assert(batch > 0 && deadline >= 0);
+
+	NetworkQueue *dest = VNN_CALLOC(sizeof(NetworkQueue));
+	dest->network = src;
+	dest->batch = batch;
+	dest->deadline = deadline;
+	dest->histogram = VNN_CALLOC(batch * sizeof(size_t));
+	dest->started = network_queue_clock();
+
+	pthread_mutex_init(&dest->lock, NULL);
+	pthread_cond_init(&dest->pending, NULL);
+	pthread_cond_init(&dest->completed, NULL);
+	if (pthread_create(&dest->thread, NULL, network_queue_run, dest) != 0) {
+		assert(false && "Unable to start the queue thread");
+	}
+
+	return dest;
+}
+
+VNNDEF void network_queue_submit(NetworkQueue *dest, NetworkRequest *request) {
+	assert(dest != NULL && request != NULL);
+	assert(request->input.rows == 1 && request->input.cols == dest->network.weights[0].rows-1);
+
+	request->done = false;
+	request->output = (Matrix) {0};
+	request->next = NULL;
+
+	pthread_mutex_lock(&dest->lock);
+	assert(!dest->stopping);
+
+	request->submitted = network_queue_clock();
+	if (dest->tail != NULL) {
+		dest->tail->next = request;
+	} else {
+		dest->head = request;
+	}
+	dest->tail = request;
+	dest->length++;
+
+	pthread_cond_signal(&dest->pending);
+	pthread_mutex_unlock(&dest->lock);
+}
+
+VNNDEF Matrix network_queue_wait(NetworkQueue *dest, NetworkRequest *request) {
+	assert(dest != NULL && request != NULL && request->callback == NULL);
+
+	pthread_mutex_lock(&dest->lock);
+	while (!request->done) {
+		pthread_cond_wait(&dest->completed, &dest->lock);
+	}
+	pthread_mutex_unlock(&dest->lock);
+
+	return request->output;
+}
+
+VNNDEF Matrix network_queue_infer(NetworkQueue *dest, Matrix input) {
+	NetworkRequest request = {.input = input};
+	network_queue_submit(dest, &request);
+	return network_queue_wait(dest, &request);
+}
+
+VNNDEF void network_queue_dump(NetworkQueue *src, FILE *stream) {
+	assert(src != NULL && stream != NULL);
+
+	pthread_mutex_lock(&src->lock);
+	double elapsed = network_queue_clock() - src->started;
+	size_t requests = src->requests > 0 ? src->requests : 1;
+
+	fprintf(stream, "Requests: %lu, Batches: %lu, Throughput: %.1f requests/s\n",
+		(unsigned long) src->requests, (unsigned long) src->batches, src->requests / elapsed);
+	fprintf(stream, "Queue latency: %.3f ms mean, %.3f ms max, Total latency: %.3f ms mean\n",
+		src->waited / requests * 1e3, src->waited_max * 1e3, src->served / requests * 1e3);
+
+	fprintf(stream, "Batch sizes:\n");
+	for (size_t i = 0; i < src->batch; i++) {
+		if (src->histogram[i] > 0) {
+			fprintf(stream, "%6lu %10lu\n", (unsigned long) i+1, (unsigned long) src->histogram[i]);
+		}
+	}
+	pthread_mutex_unlock(&src->lock);
+}
+
+VNNDEF void network_queue_free(NetworkQueue *dest) {
+	assert(dest != NULL);
+
+	// Requests still pending are served before stopping
+	pthread_mutex_lock(&dest->lock);
+	dest->stopping = true;
+	pthread_cond_signal(&dest->pending);
+	pthread_mutex_unlock(&dest->lock);
+	pthread_join(dest->thread, NULL);
+
+	pthread_mutex_destroy(&dest->lock);
+	pthread_cond_destroy(&dest->pending);
+	pthread_cond_destroy(&dest->completed);
+	VNN_FREE(dest->histogram);
+	VNN_FREE(dest);
+}
+
+VNNDEF void *network_evaluator_run(void *evaluator) {
+	NetworkEvaluator *src = evaluator;
+
+	pthread_mutex_lock(&src->lock);
+	while (true) {
+		while (!src->pending && !src->stopping) {
+			pthread_cond_wait(&src->submitted, &src->lock);
+		}
+		if (!src->pending) {
+			break;
+		}
+
+		// Buffers are swapped rather than copied, so that the next weights can come in during the evaluation
+		for (size_t i = 0; i < src->snapshot.layers-1; i++) {
+			VNN_DTYPE *data = src->snapshot.weights[i].data;
+			src->snapshot.weights[i].data = src->buffer[i].data;
+			src->buffer[i].data = data;
+		}
+		size_t tag = src->tag;
+		src->pending = false;
+		src->busy = true;
+		pthread_mutex_unlock(&src->lock);
+
+		NetworkEvaluation result = network_evaluate(src->snapshot, src->inputs, src->targets, src->batch);
+		result.tag = tag;
+
+		pthread_mutex_lock(&src->lock);
+		src->evaluations++;
+		result.improved = src->evaluations == 1 || result.loss < src->best.loss;
+		if (result.improved) {
+			src->best = result;
+			src->stale = 0;
+		} else {
+			src->stale++;
+		}
+		src->last = result;
+		bool stop = src->patience > 0 && src->stale >= src->patience;
+		pthread_mutex_unlock(&src->lock);
+
+		if (src->hook != NULL && src->hook(result, src->data)) {
+			stop = true;
+		}
+
+		pthread_mutex_lock(&src->lock);
+		src->stopped = src->stopped || stop;
+		src->busy = false;
+		pthread_cond_broadcast(&src->evaluated);
+	}
+	pthread_mutex_unlock(&src->lock);
+
+	return NULL;
+}
+
+VNNDEF NetworkEvaluator *network_evaluator_new(
+	Network src, Matrix inputs, Matrix targets, size_t batch, size_t patience,
+	bool (*hook)(NetworkEvaluation result, void *data), void *data
+) {
+	assert(!NETWORK_FREED(src) && !MATRIX_FREED(inputs) && !MATRIX_FREED(targets));
+	assert(batch > 0);
+
+	// Snapshot has the same shape and activations as `src`, while its weights are given by each submission
+	size_t *shape = VNN_ALLOC(src.layers * sizeof(size_t));
+	for (size_t i = 0; i < src.layers-1; i++) {
+		shape[i] = src.weights[i].rows-1;
+		shape[i+1] = src.weights[i].cols;
+	}
+
+	NetworkEvaluator *dest = VNN_CALLOC(sizeof(NetworkEvaluator));
+	dest->snapshot = network_new(shape, src.layers, src.rate, src.s, src.ds, NULL);
+	dest->snapshot.loss = src.loss;
+	dest->buffer = VNN_ALLOC((src.layers-1) * sizeof(Matrix));
+	for (size_t i = 0; i < src.layers-1; i++) {
+		dest->buffer[i] = matrix_empty(src.weights[i].rows, src.weights[i].cols);
+	}
+	VNN_FREE(shape);
+
+	dest->inputs = inputs;
+	dest->targets = targets;
+	dest->batch = batch;
+	dest->patience = patience;
+	dest->hook = hook;
+	dest->data = data;
+
+	pthread_mutex_init(&dest->lock, NULL);
+	pthread_cond_init(&dest->submitted, NULL);
+	pthread_cond_init(&dest->evaluated, NULL);
+	if (pthread_create(&dest->thread, NULL, network_evaluator_run, dest) != 0) {
+		assert(false && "Unable to start the evaluator thread");
+	}
+
+	return dest;
+}
+
+VNNDEF void network_evaluator_submit(NetworkEvaluator *dest, Network src, size_t tag) {
+	assert(dest != NULL && !NETWORK_FREED(src));
+	assert(src.layers == dest->snapshot.layers);
+
+	// Training only waits for the copy, and never for an evaluation in progress
+	pthread_mutex_lock(&dest->lock);
+	assert(!dest->stopping);
+	for (size_t i = 0; i < src.layers-1; i++) {
+		Matrix weights = src.weights[i];
+		assert(weights.rows == dest->buffer[i].rows && weights.cols == dest->buffer[i].cols && !weights.transposed);
+		memcpy(dest->buffer[i].data, weights.data, weights.rows*weights.cols * sizeof(VNN_DTYPE));
+	}
+	dest->tag = tag;
+	dest->pending = true;
+
+	pthread_cond_signal(&dest->submitted);
+	pthread_mutex_unlock(&dest->lock);
+}
+
+VNNDEF bool network_evaluator_stopped(NetworkEvaluator *src) {
+	assert(src != NULL);
+
+	pthread_mutex_lock(&src->lock);
+	bool stopped = src->stopped;
+	pthread_mutex_unlock(&src->lock);
+
+	return stopped;
+}
+
+VNNDEF NetworkEvaluation network_evaluator_wait(NetworkEvaluator *dest) {
+	assert(dest != NULL);
+
+	pthread_mutex_lock(&dest->lock);
+	while (dest->pending || dest->busy) {
+		pthread_cond_wait(&dest->evaluated, &dest->lock);
+	}
+	NetworkEvaluation last = dest->last;
+	pthread_mutex_unlock(&dest->lock);
+
+	return last;
+}
+
+VNNDEF void network_evaluator_free(NetworkEvaluator *dest) {
+	assert(dest != NULL);
+
+	// Weights still waiting are evaluated before stopping
+	pthread_mutex_lock(&dest->lock);
+	dest->stopping = true;
+	pthread_cond_signal(&dest->submitted);
+	pthread_mutex_unlock(&dest->lock);
+	pthread_join(dest->thread, NULL);
+
+	pthread_mutex_destroy(&dest->lock);
+	pthread_cond_destroy(&dest->submitted);
+	pthread_cond_destroy(&dest->evaluated);
+	for (size_t i = 0; i < dest->snapshot.layers-1; i++) {
+		matrix_free(&dest->buffer[i]);
+	}
+	VNN_FREE(dest->buffer);
+	network_free(&dest->snapshot);
+	VNN_FREE(dest);
+}
+#endif
+
 #endif